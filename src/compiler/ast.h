@@ -307,6 +307,7 @@ struct Var : Node {
 	bool captured = false;
 	bool is_mutable = false;
 	bool is_const = false;
+	bool is_borrowed = false;  // Set by escape pass: initialized from a field that stays alive and unchanged while this local exists, no retain/release needed.
 	string get_annotation() override;
 	DECLARE_DOM_CLASS(Var);
 };
@@ -1,4 +1,5 @@
 #include <unordered_map>
+#include <map>
 #include "utils/fake-gunit.h"
 #include "dom/dom-to-string.h"
 #include "compiler/ast.h"
@@ -6,9 +7,11 @@
 #include "compiler/name-resolver.h"
 #include "compiler/type-checker.h"
 #include "compiler/const-capture-pass.h"
+#include "compiler/escape-pass.h"
+#include "compiler/generator.h"
 #include "runtime/runtime.h"
-
-int64_t generate_and_execute(ltm::pin<ast::Ast> ast, bool add_debug_info, bool dump_ir);  // defined in `generator.h/cpp`
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
 
 namespace {
 
@@ -43,7 +46,7 @@ void ag_assert(int64_t expected, int64_t actual) {
     ASSERT_EQ(expected, actual);
 }
 
-void execute(const char* source_text, bool dump_all = false) {
+own<Ast> build_ast(const char* source_text) {
     ast::initialize();
     auto ast = own<Ast>::make();
     ast->platform_exports.insert({ "ag_fn_akTest_foreignTestFunction", (void(*)())(foreign_test_function) });
@@ -57,10 +60,16 @@ void execute(const char* source_text, bool dump_all = false) {
     resolve_names(ast);
     check_types(ast);
     const_capture_pass(ast);
+    escape_pass(ast);
+    return ast;
+}
+
+void execute(const char* source_text, bool dump_all = false, char opt_level = 0, int lazy_threads = -1) {
+    auto ast = build_ast(source_text);
     if (dump_all)
         std::cout << std::make_pair(ast.pinned(), ast->dom.pinned()) << "\n";
     foreign_test_function_state = 0;
-    generate_and_execute(ast, false, dump_all);
+    generate_and_execute(ast, false, dump_all, opt_level, lazy_threads);
 }
 
 TEST(Parser, BoolLambda) {
@@ -146,6 +155,95 @@ TEST(Parser, Loop) {
     )");
 }
 
+TEST(Parser, OptimizedLoop) {
+    execute(R"(
+      using sys { assert }
+      fn forRange(from int, to int, body(int)) {
+          loop !(from < to ? {
+              body(from);
+              from += 1
+          })
+      }
+      class Acc { sum = 0; }
+      a = Acc;
+      forRange(0, 100) i { a.sum := a.sum + i };
+      assert(4950, a.sum)
+    )", false, '2');
+}
+
+TEST(Parser, LazyJit) {
+    execute(R"(
+      using sys { assert }
+      fn fact(n int) int { n < 2 ? 1 : n * fact(n - 1) }
+      fn neverCalled() int { fact(3) }
+      class Acc { sum = 0; add(x int) { sum := sum + x } }
+      a = Acc;
+      a.add(fact(5));
+      a.add(fact(3));
+      assert(126, a.sum)
+    )", false, '2', 2);
+}
+
+TEST(Parser, JitCache) {
+    const char* source = R"(
+        fn foreignTestFunction(x int) int;
+        foreignTestFunction(42)
+    )";
+    llvm::SmallString<128> dir;
+    llvm::sys::fs::createUniqueDirectory("ag-jit-cache", dir);
+    auto root = dir.str().str();
+    llvm::sys::path::append(dir, "objects");  // doesn't exist yet
+    JitCache cache{ dir.str().str(), "akTest:1;" };
+    int64_t result = 0;
+    ASSERT_FALSE(execute_cached(build_ast(source), cache, '2', result));
+    foreign_test_function_state = 0;
+    generate_and_execute(build_ast(source), false, false, '2', -1, &cache);
+    ASSERT_EQ(42, foreign_test_function_state);
+    foreign_test_function_state = 0;
+    ASSERT_TRUE(execute_cached(build_ast(source), cache, '2', result));
+    ASSERT_EQ(42, foreign_test_function_state);
+    ASSERT_FALSE(execute_cached(build_ast(source), cache, '1', result));
+    cache.key = "akTest:2;";
+    ASSERT_FALSE(execute_cached(build_ast(source), cache, '2', result));
+    llvm::sys::fs::remove_directories(root);
+}
+
+// Hashes of `agc -cache` parts of a program having the given body of `utils.twice`.
+std::map<string, uint64_t> part_hashes(const char* twice_body) {
+    ast::initialize();
+    auto ast = own<Ast>::make();
+    unordered_map<string, string> texts{
+        { "app", "using utils { twice } using math { sqr } twice(sqr(2));" },
+        { "utils", ast::format_str("fn twice(x int) int { ", twice_body, " }") },
+        { "math", "fn sqr(a int) int { a * a }" }};
+    parse(ast, "app", [&](string name) { return texts.at(name); });
+    resolve_names(ast);
+    check_types(ast);
+    const_capture_pass(ast);
+    escape_pass(ast);
+    auto module = generate_code(ast, false);
+    std::map<string, uint64_t> r;
+    module.withModuleDo([&](llvm::Module& m) {
+        for (auto& part : split_by_source_modules(m, ast))
+            r[part.first] = module_content_hash(*part.second);
+    });
+    return r;
+}
+
+TEST(Parser, IncrementalBuildParts) {
+    auto first = part_hashes("x + x");
+    ASSERT_TRUE(first.count("app") && first.count("utils") && first.count("math"));
+    ASSERT_TRUE(first == part_hashes("x + x"));
+    auto edited = part_hashes("x * 2");
+    ASSERT_EQ(first.size(), edited.size());
+    for (auto& [name, hash] : first) {
+        if (name == "utils")
+            ASSERT_NE(hash, edited[name]);
+        else
+            ASSERT_EQ(hash, edited[name]) << " part " << name;
+    }
+}
+
 TEST(Parser, Classes) {
     execute(R"(
         class Point {
@@ -192,6 +290,53 @@ TEST(Parser, ClassMethods) {
     )");
 }
 
+TEST(Parser, DevirtualizedMethods) {
+    execute(R"(
+        class Point {
+          x = 1;
+          m() int { x }
+          get() int { x }
+        }
+        class P3 {
+          +Point{
+            m() int { x+z }
+          }
+          z = 3;
+        }
+        fn callM(p Point) int { p.m() }
+        fn callGet(p Point) int { p.get() }
+        sys_assert(1, callM(Point));
+        sys_assert(4, callM(P3));
+        sys_assert(1, callGet(P3));
+        sys_assert(4, P3.m())
+    )");
+}
+
+TEST(Parser, CachedInterfaceCalls) {
+    execute(R"(
+        interface Shape {
+          area() int;
+        }
+        class Square {
+          +Shape { area() int { a*a } }
+          a = 2;
+        }
+        class Rect {
+          +Shape { area() int { a*b } }
+          a = 2;
+          b = 3;
+        }
+        class Cube {
+          +Square;
+          +Shape { area() int { a*a*6 } }
+        }
+        fn area(s Shape) int { s.area() }
+        sys_assert(4, area(Square));
+        sys_assert(6, area(Rect));
+        sys_assert(24, area(Cube))
+    )");
+}
+
 TEST(Parser, Interfaces) {
     execute(R"(
         interface Movable {
@@ -369,6 +514,31 @@ TEST(Parser, TopoCopy) {
     )");
 }
 
+TEST(Parser, DeepCopy) {
+    execute(R"(
+        class Node {
+          next = ?Node;
+          prev = &Node;
+          grow(n int) this {
+            n > 0 ? {
+              next := Node.grow(n - 1);
+              next?_.prev := &this
+            }
+          }
+          count(expectedPrev &Node) int {
+            prev == expectedPrev
+                ? 1 + (next?_.count(&this) : 0)
+                : -100000
+          }
+        }
+        head = Node.grow(10000);
+        outer = &head;  // weak from outside of the copied hierarchy
+        c = @head;
+        sys_assert(10001, c.count(&Node));
+        sys_assert(10001, head.count(&Node))
+    )");
+}
+
 TEST(Parser, ForeignFunctionCall) {
     execute(R"(
         fn foreignTestFunction(x int) int;
@@ -437,6 +607,82 @@ TEST(Parser, BlobsAndIndexes) {
     )");
 }
 
+TEST(Parser, ContainerGrowth) {
+    execute(R"(
+        using sys {
+            Blob,
+            assert
+        }
+        class sys_Blob {
+            getAt(i int) int { get64At(i) }
+            setAt(i int, v int) { set64At(i, v) }
+        }
+        b = Blob;
+        i = 0;
+        loop !(i < 1000 ? {
+            b.insertItems(b.capacity(), 1);
+            b[i] := i;
+            i += 1
+        });
+        b.insertItems(10, 2);
+        assert(0, b[11]);
+        assert(10, b[12]);
+        b.deleteBytes(0, 8 * 900);
+        assert(102, b.capacity());
+        assert(898, b[0]);
+        assert(999, b[101])
+    )");
+}
+
+TEST(Parser, InlineBlobAccessors) {
+    execute(R"(
+        using sys { Blob, assert }
+        fn forRange(from int, to int, body(int)) {
+            loop !(from < to ? {
+                body(from);
+                from += 1
+            })
+        }
+        b = Blob;
+        b.insertItems(0, 2);
+        forRange(0, b.capacity() * 8) i { b.set8At(i, i + 250) };
+        assert(250, b.get8At(0));
+        assert(9, b.get8At(15));
+        assert(0, b.get8At(16));
+        b.set16At(7, 65535);
+        assert(65535, b.get16At(7));
+        b.set16At(8, 1);
+        assert(0, b.get16At(8));
+        b.set32At(3, 4294967295);
+        assert(4294967295, b.get32At(3));
+        assert(0, b.get32At(4));
+        b.set64At(1, -5);
+        assert(-5, b.get64At(1));
+        b.set64At(2, 7);
+        assert(0, b.get64At(2))
+    )", false, '2');
+}
+
+TEST(Parser, SharedBlobCopies) {
+    execute(R"(
+        using sys { Blob, assert }
+        b = Blob;
+        b.insertItems(0, 2);
+        b.set8At(3, 42);
+        c = @b;        // shares the buffer with `b` if built with AG_SHARED_BLOB_BUFFERS
+        d = @c;
+        c.set8At(3, 7);
+        b.set64At(1, 5);
+        assert(42, b.get8At(3));
+        assert(7, c.get8At(3));
+        assert(42, d.get8At(3));
+        assert(0, d.get64At(1));
+        d.deleteBytes(0, 8);
+        assert(0, d.get64At(0));
+        assert(5, b.get64At(1))
+    )", false, '2');
+}
+
 TEST(Parser, Delegates) {
     execute(R"(
         class Cl{
@@ -489,6 +735,32 @@ TEST(Parser, WeakArrays) {
     )");
 }
 
+TEST(Parser, Maps) {
+    execute(R"(
+        using sys { Map, WeakMap, String, Object, assert }
+        class Node {
+            x = 1;
+        }
+        m = Map(String, Node);
+        m[*"one"] := Node;
+        m[*"two"] := Node;
+        m["two"] ? _.x := 2;
+        assert(2, m.size());
+        assert(2, m["two"] ? _.x : 0);
+        c = @m;
+        assert(1, m.delete("one") ? 1:0);
+        assert(0, m["one"] ? 1:0);
+        assert(1, c["one"] ? _.x : 0);
+        assert(2, c["two"] ? _.x : 0);
+        n = Node;
+        k = *Object;
+        w = WeakMap(Object, Node);
+        w[k] := &n;
+        assert(1, w[k] && _==n ? 1:0);
+        assert(0, w[*Object] ? 1:0)
+    )");
+}
+
 TEST(Parser, RetOwnPtr) {
     execute(R"(
         class Node {
@@ -594,6 +866,28 @@ TEST(Parser, LiteralStrings) {
     )");
 }
 
+TEST(Parser, StaticStringLiterals) {
+    execute(R"(
+        using sys { String, log, assert }
+        class Holder { s = *""; }
+        h = Holder;
+        i = 0;
+        loop {
+            log("");         // no allocation
+            t = *"Hi";
+            h.s := t;
+            i += 1;
+            i == 3
+        };
+        assert(1, h.s == *"Hi" ? 1:0);
+        m = @h.s;              // copy of static literal is a regular string
+        assert('H', m.getCh());
+        a = "Hi";              // unfrozen literals stay mutable
+        a.getCh();
+        assert('i', a.getCh())
+    )");
+}
+
 TEST(Parser, StringEscapes) {
     execute(R"-(
         using sys { assert }
@@ -712,6 +1006,65 @@ TEST(Parser, Shared) {
     )-");
 }
 
+TEST(Parser, FreezeTemp) {
+    execute(R"-(
+      using sys{assert}
+      class Point {
+         x = 0;
+      }
+      class Node {
+         pt = Point;
+         next = ?Node;
+         parent = &Node;
+         at(x int) this {
+            pt.x := x
+         }
+         chain(x int) this {
+            next := Node.at(x)
+         }
+         link() this {
+            next := Node;
+            next?_.parent := &this
+         }
+      }
+      a = *Node.at(3).chain(4);   // fresh hierarchy, frozen in place
+      assert(a.pt.x, 3);
+      assert(a.next?_.pt.x : 0, 4);
+      l = Node.at(5);
+      b = *l;                     // named local, frozen by copy
+      l.pt.x := 6;
+      assert(b.pt.x, 5);
+      c = *Node.at(7).link();     // weak to the temp, frozen by copy
+      assert(c.pt.x, 7)
+    )-");
+}
+
+TEST(Parser, BorrowedLocals) {
+    execute(R"-(
+      using sys{assert}
+      class Point {
+         x = 0;
+      }
+      class Line {
+         a = Point;
+         b = Point;
+      }
+      l = Line;
+      l.b.x := 5;
+      p = {
+         b = l.b;
+         b
+      };
+      assert(5, p.x);
+      s = *Line;
+      assert(0, {
+         a = s.a;
+         assert(0, a.x);
+         a
+      }.x)
+    )-");
+}
+
 TEST(Parser, Consts) {
     execute(R"-(
       using sys{assert}
@@ -876,6 +1229,26 @@ TEST(Parser, AsyncFfi) {
     )-");
 }
 
+TEST(Parser, Timers) {
+    execute(R"-(
+        class App{
+            fired = 0;
+            onTimer() { fired += 1 }
+            onCanceled() { fired += 100 }
+            onLast() {
+                sys_assert(1, fired);
+                sys_setMainObject(?sys_Object);
+            }
+        }
+        app = App;
+        sys_setMainObject(app);
+        id = sys_postTimer(0, app.onCanceled);
+        sys_postTimer(0, app.onTimer);
+        sys_assert(1, sys_cancelTimer(id) ? 1 : 0);
+        sys_postTimer(1, app.onLast);
+    )-");
+}
+
 TEST(Parser, Multithreading) {
     execute(R"-(
         class App{
@@ -894,6 +1267,75 @@ TEST(Parser, Multithreading) {
     )-");
 }
 
+// Weak blocks of the root's subobjects were made on the main thread, so the worker copies them as foreign ones.
+TEST(Parser, CopyForeignWeakTargets) {
+    execute(R"-(
+        class Item { peer = &Item; }
+        class Box {
+            first = &Item;  // copied before its target
+            x = Item;
+            y = Item;
+            out = &Item;    // target stays outside of the copy
+        }
+        class Root {
+            box = Box;
+            other = Item;
+            init() this {
+                box.first := &box.x;
+                box.x.peer := &box.y;  // target is copied before this weak
+                box.out := &other;
+            }
+        }
+        class App {
+            worker = sys_Thread(Root).start(Root.init());
+        }
+        app = App;
+        sys_setMainObject(app);
+        app.worker.root().&check(onEnd &()) {
+            this~Root ? {
+                c = @_.box;
+                sys_assert(1, c.first == &c.x ? 1 : 0);
+                sys_assert(1, c.x.peer == &c.y ? 1 : 0);
+                sys_assert(1, c.out == &_.other ? 1 : 0);
+                sys_assert(1, _.box.first == &_.box.x ? 1 : 0)
+            };
+            onEnd~()
+        }~(app.&onEnd() {
+            sys_setMainObject(?sys_Object)
+        });
+    )-");
+}
+
+// Both threads retain and release the same static literal.
+TEST(Parser, StaticStringLiteralsInThreads) {
+    execute(R"-(
+        class Holder { s = *""; }
+        class App {
+            worker = sys_Thread(Holder).start(Holder);
+            h = Holder;
+        }
+        fn fill(h Holder) {
+            i = 0;
+            loop {
+                h.s := *"Hi";
+                i += 1;
+                i == 100000
+            }
+        }
+        app = App;
+        sys_setMainObject(app);
+        app.worker.root().&work(text *sys_String, onEnd &(*sys_String)) {
+            this~Holder ? fill(_);
+            onEnd~(text)
+        }~(*"Hi", app.&onEnd(text *sys_String) {
+            sys_assert(1, text == *"Hi" ? 1 : 0);
+            sys_assert(1, h.s == text ? 1 : 0);
+            sys_setMainObject(?sys_Object)
+        });
+        fill(app.h);
+    )-");
+}
+
 TEST(Parser, FnReturn) {
     execute(R"-(
         fn myFunction() int {
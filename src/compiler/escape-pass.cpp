@@ -0,0 +1,116 @@
+#include "compiler/escape-pass.h"
+
+using std::vector;
+using ltm::pin;
+using ltm::own;
+
+namespace {
+
+// Detects actions that can execute user code or modify object fields.
+struct MutationFinder : ast::ActionScanner {
+	bool found = false;
+
+	void on_call(ast::Call& node) override { found = true; }
+	void on_async_call(ast::AsyncCall& node) override { found = true; }
+	void on_get_at_index(ast::GetAtIndex& node) override { found = true; }
+	void on_set_at_index(ast::SetAtIndex& node) override { found = true; }
+	void on_set_field(ast::SetField& node) override { found = true; }
+	void on_splice_field(ast::SpliceField& node) override { found = true; }
+	void on_copy(ast::CopyOp& node) override { found = true; }  // afterCopy
+	void on_freeze(ast::FreezeOp& node) override { found = true; }  // afterCopy
+	void on_to_str(ast::ToStrOp& node) override { found = true; }
+};
+
+bool can_mutate(own<ast::Action>& action) {
+	MutationFinder f;
+	f.fix(action);
+	return f.found;
+}
+
+// Local `l = v.field.field...` needs no retain/release if `v` is an immutable not captured local
+// (so it keeps its object alive for the whole `l` scope), and fields on the path cannot change
+// while `l` is alive: either `v` is frozen or nothing in the `l` scope can run code or assign fields.
+struct EscapePass : ast::ActionScanner {
+	pin<ast::Ast> ast;
+
+	EscapePass(pin<ast::Ast> ast) : ast(ast) {}
+
+	void fix_globals() {
+		for (auto& c : ast->classes_in_order) {
+			for (auto& f : c->fields)
+				fix(f->initializer);
+			for (auto& m : c->new_methods)
+				fix_fn(*m);
+			for (auto& b : c->overloads)
+				for (auto& m : b.second)
+					fix_fn(*m);
+		}
+		for (auto& m : ast->modules) {
+			for (auto& f : m.second->functions)
+				fix_fn(*f.second);
+			for (auto& t : m.second->tests)
+				fix_fn(*t.second);
+			if (m.second->entry_point)
+				fix_fn(*m.second->entry_point);
+		}
+	}
+	// Lambda names are params owned by caller, they are handled by the generator on their own.
+	void fix_fn(ast::Block& fn) {
+		for (auto& a : fn.body)
+			fix(a);
+	}
+	static bool is_local(ast::Var& v) {
+		return !v.is_mutable && !v.captured && !v.is_const;
+	}
+	// Returns root of `v.f1.f2...` chain or null
+	static pin<ast::Get> get_field_chain_root(own<ast::Action>& action) {
+		auto field = dom::strict_cast<ast::GetField>(action);
+		if (!field)
+			return nullptr;
+		for (;;) {
+			if (auto as_field = dom::strict_cast<ast::GetField>(field->base)) {
+				field = as_field;
+			} else {
+				auto root = dom::strict_cast<ast::Get>(field->base);
+				return root && is_local(*root->var.pinned()) ? root : nullptr;
+			}
+		}
+	}
+	void on_block(ast::Block& node) override {
+		// mutations[i] - can anything after names[i] initializer mutate fields.
+		vector<bool> mutations(node.names.size());
+		bool mutated = false;
+		for (auto& a : node.body)
+			mutated = mutated || can_mutate(a);
+		for (size_t i = node.names.size(); i-- > 0;) {
+			mutations[i] = mutated;
+			mutated = mutated || can_mutate(node.names[i]->initializer);
+		}
+		for (size_t i = 0; i < node.names.size(); i++) {
+			auto& l = node.names[i];
+			if (!l->initializer)
+				continue;
+			fix(l->initializer);
+			if (!is_local(*l))
+				continue;
+			if (auto root = get_field_chain_root(l->initializer)) {
+				l->is_borrowed = !mutations[i] || dom::isa<ast::TpShared>(*root->type());
+			}
+		}
+		for (auto& a : node.body)
+			fix(a);
+	}
+	void on_mk_lambda(ast::MkLambda& node) override {
+		fix_fn(node);
+	}
+	void on_immediate_delegate(ast::ImmediateDelegate& node) override {
+		fix_fn(node);
+		fix(node.base);
+	}
+};
+
+}  // namespace
+
+void escape_pass(ltm::pin<ast::Ast> ast) {
+	EscapePass(ast).fix_globals();
+}
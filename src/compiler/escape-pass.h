@@ -0,0 +1,9 @@
+#ifndef _AK_ESCAPE_PASS_H_
+#define _AK_ESCAPE_PASS_H_
+
+#include "compiler/ast.h"
+
+// Marks immutable locals that borrow a field of another local, see `ast::Var::is_borrowed`.
+void escape_pass(ltm::pin<ast::Ast> ast);
+
+#endif  // _AK_ESCAPE_PASS_H_
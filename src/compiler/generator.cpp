@@ -5,18 +5,31 @@
 #include <random>
 #include <variant>
 #include <list>
+#include <map>
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/LLJIT.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/DIBuilder.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/FileSystem.h"
 #include "llvm/Support/InitLLVM.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 #include "utils/vmt_util.h"
 #include "runtime/runtime.h"
 
 #include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Support/MemoryBuffer.h"
 
 using std::string;
 using std::vector;
@@ -37,6 +50,12 @@ using dom::isa;
 
 const int AG_HEADER_OFFSET = 0; // -1 if dispatcher and counter to be accessed by negative offsets (which speeds up all ffi, but is incompatible with moronic LLVM debug info)
 
+#ifdef AG_SHARED_BLOB_BUFFERS
+const bool AG_SHARED_BLOB_BUFFERS_MODE = true;  // runtime blob copies share buffers with prefix counters, see runtime.c
+#else
+const bool AG_SHARED_BLOB_BUFFERS_MODE = false;
+#endif
+
 // TODO remove when LLVM get sane: in release builds on Windows LLVM inserts call to these functions but doesn't define them.
 extern "C" LLVM_EXTERNAL_VISIBILITY void LLVMInitializeWebAssemblyTargetInfo() {}
 extern "C" LLVM_EXTERNAL_VISIBILITY void LLVMInitializeWebAssemblyTarget() {}
@@ -216,6 +235,7 @@ struct Generator : ast::ActionScanner {
 	llvm::Function* fn_allocate = nullptr; // Obj*(size_t)
 	llvm::Function* fn_copy = nullptr;   // Obj*(Obj*)
 	llvm::Function* fn_freeze = nullptr;   // Obj*(Obj*)
+	llvm::Function* fn_freeze_temp = nullptr;  // Obj*(Obj*) consumes its retained parameter
 	llvm::Function* fn_mk_weak = nullptr;   // WB*(Obj*)
 	llvm::Function* fn_deref_weak = nullptr;   // intptr_aka_?obj* (WB*)
 	llvm::Function* fn_copy_object_field = nullptr;   // Obj* (Obj* src, Obj* parent)
@@ -239,12 +259,18 @@ struct Generator : ast::ActionScanner {
 	llvm::FunctionType* dispatcher_fn_type = nullptr;
 	llvm::Constant* empty_mtable = nullptr; // void_ptr[1] = { null }
 	unordered_map<weak<ast::MkLambda>, llvm::Function*> compiled_functions;
+	ITableStats* i_table_stats = nullptr;
+	unordered_map<weak<ast::Class>, unordered_set<string>> overridden_below;  // class -> names of its methods overridden in subclasses
+	unordered_map<weak<ast::Class>, vector<weak<ast::Class>>> interface_implementors;
+	static const size_t max_inline_cache_size = 4;  // interface call sites with more implementors use dispatcher only
 	llvm::Constant* null_weak = nullptr;
 	llvm::Constant* const_0 = nullptr;
 	llvm::Constant* const_1 = nullptr;
 	llvm::Constant* const_256 = nullptr;
 	llvm::Constant* const_ctr_step = nullptr;
 	llvm::Constant* const_null_ptr = nullptr;
+	llvm::MDNode* tbaa_container = nullptr;  // size and data fields of Blobs and Arrays
+	llvm::MDNode* tbaa_items = nullptr;      // Blob and Array items, never overlap container fields
 	unordered_map<
 		vector<llvm::Constant*>,
 		llvm::Constant*,
@@ -255,7 +281,7 @@ struct Generator : ast::ActionScanner {
 		, context(new llvm::LLVMContext)
 		, layout("")
 	{
-		module = std::make_unique<llvm::Module>("code", *context);
+		module = std::make_unique<llvm::Module>("code", *context);  // also a key in jit cache
 		if (debug_info_mode)
 			make_di_basic();
 		int_type = llvm::Type::getInt64Ty(*context);
@@ -280,6 +306,12 @@ struct Generator : ast::ActionScanner {
 		const_256 = llvm::ConstantInt::get(tp_int_ptr, 256);
 		const_ctr_step = llvm::ConstantInt::get(tp_int_ptr, AG_CTR_STEP);
 		const_null_ptr = llvm::ConstantPointerNull::get(ptr_type);
+		llvm::MDBuilder md(*context);
+		auto tbaa_root = md.createTBAARoot("ag_tbaa");
+		auto tbaa_container_type = md.createTBAAScalarTypeNode("ag_container", tbaa_root);
+		auto tbaa_items_type = md.createTBAAScalarTypeNode("ag_items", tbaa_root);
+		tbaa_container = md.createTBAAStructTagNode(tbaa_container_type, tbaa_container_type, 0);
+		tbaa_items = md.createTBAAStructTagNode(tbaa_items_type, tbaa_items_type, 0);
 
 		fn_dispose = llvm::Function::Create(
 			llvm::FunctionType::get(void_type, { ptr_type }, false),
@@ -351,6 +383,11 @@ struct Generator : ast::ActionScanner {
 			llvm::Function::ExternalLinkage,
 			"ag_freeze",
 			*module);
+		fn_freeze_temp = llvm::Function::Create(
+			llvm::FunctionType::get(ptr_type, { ptr_type }, false),
+			llvm::Function::ExternalLinkage,
+			"ag_freeze_temp",
+			*module);
 		fn_copy_object_field = llvm::Function::Create(
 			llvm::FunctionType::get(ptr_type, { ptr_type, ptr_type }, false),
 			llvm::Function::ExternalLinkage,
@@ -540,7 +577,7 @@ struct Generator : ast::ActionScanner {
 					0,  // line
 					layout.getPointerSizeInBits(),
 					0,  // align
-					struct_layout->getElementOffsetInBits(i - 2),
+					struct_layout->getElementOffsetInBits(i - 3),
 					llvm::DINode::DIFlags::FlagZero,
 					di_int));
 				// llvm::SmallVector<uint64_t, 4> ops;
@@ -554,7 +591,7 @@ struct Generator : ast::ActionScanner {
 					0,  // line
 					layout.getPointerSizeInBits(),
 					0,  // align
-					struct_layout->getElementOffsetInBits(i - 1),
+					struct_layout->getElementOffsetInBits(i - 2),
 					llvm::DINode::DIFlags::FlagZero,
 					di_builder->createPointerType(
 						di_builder->createArrayType(
@@ -866,6 +903,37 @@ struct Generator : ast::ActionScanner {
 		result->lifetime = Val::Retained{};
 	}
 
+	// Frozen string literals are static pre-initialized objects with immortal counters, shared by all evaluations.
+	// They are reachable from all threads at once, so they are born MT: runtime retains/releases them atomically
+	// and never rewrites their counters when passing them between threads.
+	unordered_map<string, llvm::GlobalVariable*> string_literals;
+
+	llvm::GlobalVariable* get_string_literal(const string& text) {
+		auto& r = string_literals[text];
+		if (!r) {
+			auto& str = classes[ast->string_cls];
+			r = new llvm::GlobalVariable(
+				*module,
+				str.fields,
+				false,  // counter is mutable
+				llvm::GlobalValue::PrivateLinkage,
+				llvm::ConstantStruct::get(str.fields, {
+					str.dispatcher,
+					llvm::ConstantInt::get(tp_int_ptr, AG_CTR_IMMORTAL | AG_CTR_MT),
+					llvm::ConstantInt::get(tp_int_ptr, AG_SHARED | AG_F_PARENT),
+					llvm::ConstantExpr::getPtrToInt(builder->CreateGlobalStringPtr(text), int_type),  // _cursor
+					llvm::ConstantInt::get(int_type, 0) }));  // _buffer
+		}
+		return r;
+	}
+
+	// String literals passed as conform refs, like in `log("text")`, can't be modified by callee, so they don't need own objects.
+	[[nodiscard]] Val comp_param(own<ast::Action>& param, const own<ast::Type>& param_type) {
+		if (auto as_str = dom::strict_cast<ast::ConstString>(param); as_str && isa<ast::TpConformRef>(*param_type))
+			return Val{ param->type(), get_string_literal(as_str->value), Val::NonPtr{} };
+		return comp_to_persistent(param);
+	}
+
 	unordered_map<ast::Type*, llvm::DISubroutineType*> di_fn_types;
 
 	llvm::DISubroutineType* to_di_fn_type(ast::Type& tp) {
@@ -1179,17 +1247,160 @@ struct Generator : ast::ActionScanner {
 	}
 
 	// `closure_ptr_type` define the type of `this` or `closure` parameter.
+	// Class hierarchy analysis: if true, the receiver of static class `cls` can dispatch this method to another implementation.
+	bool is_overridden_below(pin<ast::Class> cls, ast::Method& method) {
+		auto it = overridden_below.find(cls);
+		return it != overridden_below.end() && it->second.count(method.name) != 0;
+	}
+
+	// Builds inline code for the hot Blob/Array item accessors instead of calling `fn`, with the same semantics
+	// as their runtime implementations. Returns nullptr if `fn` is not such an accessor.
+	// Container fields and items have different TBAA tags, so LLVM hoists `size` and `data` loads out of loops
+	// that only access items, and folds bounds checks dominated by loop conditions like `i < b.capacity()`.
+	// With AG_SHARED_BLOB_BUFFERS setters write inline only to blobs that are the only users of their buffers, others call `fn` to unshare it.
+	llvm::Value* build_inline_accessor(llvm::Function* fn, const vector<llvm::Value*>& params) {
+		static const struct {
+			const char* name;
+			int log_items_per_slot;  // blob items in one 64-bit slot
+			bool is_set;
+		} accessors[] = {
+			{ "ag_m_sys_Blob_get8At", 3, false },
+			{ "ag_m_sys_Blob_set8At", 3, true },
+			{ "ag_m_sys_Blob_get16At", 2, false },
+			{ "ag_m_sys_Blob_set16At", 2, true },
+			{ "ag_m_sys_Blob_get32At", 1, false },
+			{ "ag_m_sys_Blob_set32At", 1, true },
+			{ "ag_m_sys_Blob_get64At", 0, false },
+			{ "ag_m_sys_Blob_set64At", 0, true },
+			{ "ag_m_sys_Array_getAt", 0, false }};
+		auto acc = std::find_if(std::begin(accessors), std::end(accessors), [&](auto& a) { return fn->getName() == a.name; });
+		if (acc == std::end(accessors))
+			return nullptr;
+		bool is_array = !strcmp(acc->name, "ag_m_sys_Array_getAt");
+		auto container = ast->blob->base_class.pinned().cast<ast::Class>();
+		auto container_fields = classes[container].fields;
+		auto receiver = params[0];
+		auto index = params[1];
+		auto load_container_field = [&](ast::Field& f) {
+			auto r = builder->CreateLoad(int_type, builder->CreateStructGEP(container_fields, receiver, f.offset));
+			r->setMetadata(llvm::LLVMContext::MD_tbaa, tbaa_container);
+			return r;
+		};
+		auto in_bounds = builder->CreateICmpULT(
+			builder->CreateLShr(index, acc->log_items_per_slot),
+			load_container_field(*container->fields[0]));  // _size
+		auto entry_bb = builder->GetInsertBlock();
+		auto access_bb = llvm::BasicBlock::Create(*context, "", current_ll_fn);
+		auto done_bb = llvm::BasicBlock::Create(*context, "", current_ll_fn);
+		bool check_buffer_users = acc->is_set && AG_SHARED_BLOB_BUFFERS_MODE;
+		auto owned_bb = check_buffer_users
+			? llvm::BasicBlock::Create(*context, "", current_ll_fn)
+			: access_bb;
+		auto slow_bb = check_buffer_users
+			? llvm::BasicBlock::Create(*context, "", current_ll_fn)
+			: done_bb;
+		builder->CreateCondBr(in_bounds, owned_bb, slow_bb);
+		builder->SetInsertPoint(owned_bb);
+		auto data = builder->CreateIntToPtr(load_container_field(*container->fields[1]), ptr_type);  // _data
+		if (check_buffer_users) {
+			// Buffer is prefixed with a counter of blobs sharing it, copies can release it on other threads.
+			auto buffer_users = builder->CreateLoad(int_type, builder->CreateGEP(int_type, data, builder->getInt64(-1)));
+			buffer_users->setAtomic(llvm::AtomicOrdering::Monotonic);
+			buffer_users->setMetadata(llvm::LLVMContext::MD_tbaa, tbaa_container);
+			builder->CreateCondBr(
+				builder->CreateICmpEQ(buffer_users, llvm::ConstantInt::get(int_type, 1)),
+				access_bb,
+				slow_bb);
+			builder->SetInsertPoint(access_bb);
+		}
+		auto item_type = is_array
+			? (llvm::Type*)ptr_type
+			: (llvm::Type*)builder->getIntNTy(64 >> acc->log_items_per_slot);
+		auto item_addr = builder->CreateGEP(item_type, data, index);
+		if (acc->is_set) {
+			builder->CreateStore(builder->CreateTrunc(params[2], item_type), item_addr)
+				->setMetadata(llvm::LLVMContext::MD_tbaa, tbaa_items);
+			builder->CreateBr(done_bb);
+			if (check_buffer_users) {
+				builder->SetInsertPoint(slow_bb);
+				builder->CreateCall(fn, params);
+				builder->CreateBr(done_bb);
+			}
+			builder->SetInsertPoint(done_bb);
+			return llvm::UndefValue::get(void_type);
+		}
+		auto item = builder->CreateLoad(item_type, item_addr);
+		item->setMetadata(llvm::LLVMContext::MD_tbaa, tbaa_items);
+		llvm::Value* r = item;
+		if (is_array) {
+			build_retain(item, ast->tp_optional(ast->get_ref(ast->object)));  // as `ag_retain_pin`
+		} else {
+			r = builder->CreateZExt(item, int_type);
+		}
+		auto loaded_bb = builder->GetInsertBlock();
+		builder->CreateBr(done_bb);
+		builder->SetInsertPoint(done_bb);
+		auto phi = builder->CreatePHI(r->getType(), 2);
+		phi->addIncoming(llvm::Constant::getNullValue(r->getType()), entry_bb);
+		phi->addIncoming(r, loaded_bb);
+		return phi;
+	}
+
+	// Compares receiver dispatcher with cached ones and calls the matched method directly, on miss calls `get_entry_point(dispatcher)`.
+	llvm::Value* build_cached_call(
+		llvm::Value* receiver,
+		const vector<std::pair<llvm::Value*, llvm::Function*>>& cache,
+		llvm::FunctionType* fn_type,
+		const vector<llvm::Value*>& params,
+		const std::function<llvm::Value* (llvm::Value*)>& get_entry_point)
+	{
+		auto disp = builder->CreateLoad(ptr_type, builder->CreateConstGEP2_32(obj_struct, receiver, AG_HEADER_OFFSET, 0));
+		if (cache.empty())
+			return builder->CreateCall(llvm::FunctionCallee(fn_type, get_entry_point(disp)), params);
+		auto joined_bb = llvm::BasicBlock::Create(*context, "", current_ll_fn);
+		vector<std::pair<llvm::Value*, llvm::BasicBlock*>> results;
+		for (auto& entry : cache) {
+			auto hit_bb = llvm::BasicBlock::Create(*context, "", current_ll_fn);
+			auto miss_bb = llvm::BasicBlock::Create(*context, "", current_ll_fn);
+			builder->CreateCondBr(builder->CreateICmpEQ(disp, entry.first), hit_bb, miss_bb);
+			builder->SetInsertPoint(hit_bb);
+			results.push_back({ builder->CreateCall(llvm::FunctionCallee(fn_type, entry.second), params), hit_bb });
+			builder->CreateBr(joined_bb);
+			builder->SetInsertPoint(miss_bb);
+		}
+		results.push_back({
+			builder->CreateCall(llvm::FunctionCallee(fn_type, get_entry_point(disp)), params),
+			builder->GetInsertBlock() });
+		builder->CreateBr(joined_bb);
+		builder->SetInsertPoint(joined_bb);
+		if (fn_type->getReturnType()->isVoidTy())
+			return llvm::UndefValue::get(void_type);
+		auto phi = builder->CreatePHI(fn_type->getReturnType(), results.size());
+		for (auto& r : results)
+			phi->addIncoming(r.first, r.second);
+		return phi;
+	}
+
+	llvm::Function* declare_function(ast::MkLambda& node, const string& name, bool is_external) {
+		auto& fn = compiled_functions[&node];
+		if (!fn) {
+			fn = llvm::Function::Create(
+				lambda_to_llvm_fn(node, node.type()),
+				is_external
+					? llvm::Function::ExternalLinkage
+					: llvm::Function::InternalLinkage,
+				name,
+				module.get());
+		}
+		return fn;
+	}
+
 	llvm::Function* compile_function(ast::MkLambda& node, string name, llvm::Type* closure_ptr_type, bool is_external) {
-		if (auto seen = compiled_functions[&node])
+		auto seen = compiled_functions[&node];
+		if (seen && (is_external || !seen->empty()))  // methods can be declared ahead for direct calls
 			return seen;
 		llvm::Function* prev = current_ll_fn;
-		current_ll_fn = llvm::Function::Create(
-			lambda_to_llvm_fn(node, node.type()),
-			is_external
-				? llvm::Function::ExternalLinkage
-				: llvm::Function::InternalLinkage,
-			name,
-			module.get());
+		current_ll_fn = declare_function(node, name, is_external);
 		if (!is_external) {
 			compile_fn_body(node, name, closure_ptr_type);
 		}
@@ -1223,14 +1434,23 @@ struct Generator : ast::ActionScanner {
 			: nullptr;
 		vector<Val> to_dispose; // mutable ? addr : initializer_value
 		for (auto& l : node.names) {
-			to_dispose.push_back(
-				l->initializer ? comp_to_persistent(l->initializer) :
-				parameter.data ? parameter :
-				Val{
-					l->type,
-					make_opt_none(l->type.cast<ast::TpOptional>()),
-					Val::NonPtr{} 
-				});
+			if (l->is_borrowed) {  // see escape-pass
+				auto val = compile(l->initializer);
+				if (get_if<Val::Temp>(&val.lifetime) && !val.optional_br)
+					val.lifetime = Val::Temp{ l };  // retained only if it leaves the block
+				else
+					val = persist_val(move(val));
+				to_dispose.push_back(move(val));
+			} else {
+				to_dispose.push_back(
+					l->initializer ? comp_to_persistent(l->initializer) :
+					parameter.data ? parameter :
+					Val{
+						l->type,
+						make_opt_none(l->type.cast<ast::TpOptional>()),
+						Val::NonPtr{}
+					});
+			}
 			auto& initializer = to_dispose.back();
 			if (l->is_mutable || l->captured) {
 				auto& addr = locals[l];
@@ -1425,28 +1645,43 @@ struct Generator : ast::ActionScanner {
 				false ));  // perist_mutable_locals
 			auto receiver = to_dispose.back().data;
 			params.front() = cast_to(receiver, ptr_type);
-			if (method->cls->is_interface) {
-				auto entry_point = builder->CreateCall(
-					llvm::FunctionCallee(
-						dispatcher_fn_type,
-						builder->CreateLoad(ptr_type, builder->CreateConstGEP2_32(obj_struct, receiver, AG_HEADER_OFFSET, 0))
-					),
-					{ builder->getInt64(classes[method->cls].interface_ordinal | m_info.ordinal) });
-				result->data = builder->CreateCall(
-					llvm::FunctionCallee(m_info.type, entry_point),
-					move(params));
+			auto receiver_cls = ast->extract_class(calle_as_method->base->type());
+			auto impl_cls = receiver_cls ? receiver_cls->get_implementation() : nullptr;
+			auto impl_fn = impl_cls && !impl_cls->is_interface
+				? compiled_functions[calle_as_method->method.pinned()]
+				: nullptr;
+			if (impl_fn && !is_overridden_below(impl_cls, *calle_as_method->method.pinned())) {
+				// No subclass overrides it, call directly.
+				auto inlined = build_inline_accessor(impl_fn, params);
+				result->data = inlined
+					? inlined
+					: builder->CreateCall(llvm::FunctionCallee(m_info.type, impl_fn), params);
 			} else {
-				result->data = builder->CreateCall(
-					llvm::FunctionCallee(
-						m_info.type,
-						builder->CreateLoad(  // load ptr to fn
+				// Inline cache: known receiver classes get direct calls, others go through vmt or interface dispatcher.
+				vector<std::pair<llvm::Value*, llvm::Function*>> cache;  // dispatcher, method
+				if (impl_fn) {
+					cache.push_back({ classes[impl_cls].dispatcher, impl_fn });  // guess that receiver is exactly of its static class
+				} else if (impl_cls && impl_cls->is_interface && method->cls->is_interface) {
+					auto& impls = interface_implementors[impl_cls];
+					if (impls.size() <= max_inline_cache_size) {
+						for (auto& c : impls) {
+							auto m = c->interface_vmts[method->cls][method->ordinal].pinned();
+							if (auto fn = compiled_functions[m])
+								cache.push_back({ classes[c].dispatcher, fn });
+						}
+						if (cache.size() != impls.size())
+							cache.clear();
+					}
+				}
+				result->data = build_cached_call(receiver, cache, m_info.type, params, [&](llvm::Value* disp) {
+					return method->cls->is_interface
+						? (llvm::Value*)builder->CreateCall(
+							llvm::FunctionCallee(dispatcher_fn_type, disp),
+							{ builder->getInt64(classes[method->cls].interface_ordinal | m_info.ordinal) })
+						: builder->CreateLoad(  // load ptr to fn
 							ptr_type,
-							builder->CreateConstGEP2_32(
-								classes[method->cls].vmt,
-								builder->CreateLoad(ptr_type, builder->CreateConstGEP2_32(obj_struct, receiver, AG_HEADER_OFFSET, 0)),
-								-1,
-								m_info.ordinal))),
-					move(params));
+							builder->CreateConstGEP2_32(classes[method->cls].vmt, disp, -1, m_info.ordinal));
+				});
 			}
 		} else if (auto as_delegate_type = dom::strict_cast<ast::TpDelegate>(node.callee->type())) {
 			auto result_type = dom::strict_cast<ast::TpOptional>(node.type());
@@ -1456,7 +1691,7 @@ struct Generator : ast::ActionScanner {
 			params.push_back(cast_to(retained_receiver_pin, ptr_type)); 
 			auto pt = as_delegate_type->params.begin();
 			for (auto& p : node.params) {
-				to_dispose.push_back(comp_to_persistent(p));
+				to_dispose.push_back(comp_param(p, *pt));
 				params.push_back(cast_to(to_dispose.back().data, to_llvm_type(**(pt++))));
 			}
 			*result = compile_if(
@@ -1490,8 +1725,9 @@ struct Generator : ast::ActionScanner {
 					? function_to_llvm_fn(*node.callee, node.callee->type())
 					: lambda_to_llvm_fn(*node.callee, node.callee->type());
 			auto pt = function_type->params().begin() + (is_fn ? 0 : 1);
+			auto ast_pt = node.callee->type().cast<ast::TpFunction>()->params.begin();
 			for (auto& p : node.params) {
-				to_dispose.push_back(comp_to_persistent(p));
+				to_dispose.push_back(comp_param(p, *ast_pt++));
 				params.push_back(cast_to(to_dispose.back().data, *pt++));
 			}
 			auto callee = compile(node.callee);
@@ -1587,7 +1823,7 @@ struct Generator : ast::ActionScanner {
 		tramp.first = llvm::Function::Create(
 			trampoline_fn_type,
 			llvm::Function::InternalLinkage,
-			ast::format_str("ag_tr_", (void*)type),
+			ast::format_str("ag_tr_", pin<ast::Type>(type)),  // stable across runs, unlike the type address
 			module.get());
 		llvm::Function* prev = current_ll_fn;
 		current_ll_fn = tramp.first;
@@ -1904,9 +2140,19 @@ struct Generator : ast::ActionScanner {
 		internal_error(node, "ref cannot be compiled");
 	}
 	void on_freeze(ast::FreezeOp& node) override {
+		if (auto as_str = dom::strict_cast<ast::ConstString>(node.p)) {
+			result->data = get_string_literal(as_str->value);
+			result->lifetime = Val::Temp{};  // held by the image, retained if stored
+			return;
+		}
 		auto src = compile(node.p);
-		result->data = builder->CreateCall(fn_freeze, { src.data });
 		result->lifetime = Val::Retained{};
+		if (get_if<Val::Retained>(&src.lifetime)) {
+			// Nobody else can see the temp, so runtime can freeze it in place if its hierarchy has no outer references.
+			result->data = builder->CreateCall(fn_freeze_temp, { src.data });
+			return;
+		}
+		result->data = builder->CreateCall(fn_freeze, { src.data });
 		dispose_val(move(src));
 	}
 	void on_cast(ast::CastOp& node) override {
@@ -2652,12 +2898,17 @@ struct Generator : ast::ActionScanner {
 		return matcher.result;
 	}
 
+	// Builds a single-load interface table indexed by a perfect hash of the interface ordinal.
 	llvm::Value* build_i_table(
 		string prefix_name,
 		llvm::IRBuilder<>& builder,
 		unordered_map<uint64_t, llvm::Constant*> vmts,
 		llvm::Value* interface_and_method)
 	{
+		if (i_table_stats) {
+			i_table_stats->classes++;
+			i_table_stats->interfaces += vmts.size();
+		}
 		if (vmts.size() < 2) {
 			return cast_to(
 				vmts.empty()
@@ -2665,65 +2916,26 @@ struct Generator : ast::ActionScanner {
 					: vmts.begin()->second,
 				ptr_type);
 		}
-		auto best = vmt_util::find_best_fit(vmts);
-		bool has_splinter = best.width - best.pos == best.splinter;
-		llvm::Value* current_interface_index = interface_and_method;
-		if (best.pos != 63 || has_splinter)
-			current_interface_index = builder.CreateAnd(
-				current_interface_index,
-				builder.getInt64(
-					1ull << best.splinter |
-					(~0ull >> (64 - best.width)) << best.pos));
-		if (has_splinter)
-			current_interface_index = builder.CreateAdd(
-				current_interface_index,
-				builder.getInt64(
-					(~0ull >> (64 - (best.pos + best.width - best.splinter)) << best.splinter)));
-		current_interface_index = builder.CreateLShr(current_interface_index, builder.getInt64(best.pos - best.width + 1));
-		if (best.spread == vmts.size()) {  // exact match
-			vector<llvm::Constant*> i_table(1 << best.width, empty_mtable);
-			for (auto& ord : vmts)
-				i_table[vmt_util::extract_key_bits(ord.first, best.pos, best.width, best.splinter)] = llvm::ConstantExpr::getBitCast(ord.second, ptr_type);
-
-			auto llvm_itable = make_const_array(prefix_name, move(i_table));
-			return builder.CreateLoad(
-				ptr_type,
-				builder.CreateGEP(
-					ptr_type,
-					llvm_itable,
-					current_interface_index));
-		}
-		vector<unordered_map<uint64_t, llvm::Constant*>> indirect_table;
-		indirect_table.resize(1 << best.width);
+		auto hash = vmt_util::find_perfect_hash(vmts);
+		vector<llvm::Constant*> i_table(size_t(1) << hash.width, empty_mtable);
 		for (auto& ord : vmts)
-			indirect_table[vmt_util::extract_key_bits(ord.first, best.pos, best.width, best.splinter)].insert({ ord.first, ord.second });
-		vector<llvm::BasicBlock*> dst_table;
-		vector<llvm::Constant*> jump_table;
-		int i = 0;
-		auto combined_block = llvm::BasicBlock::Create(*context, "", builder.GetInsertPoint()->getFunction());
-		llvm::IRBuilder<> combined_builder(combined_block);
-		auto combined_result = combined_builder.CreatePHI(ptr_type, indirect_table.size());
-		for (auto& submap : indirect_table) {
-			dst_table.push_back(llvm::BasicBlock::Create(*context, "", builder.GetInsertPoint()->getFunction()));
-			llvm::IRBuilder<> b(dst_table.back());
-			auto val = build_i_table(ast::format_str(prefix_name, "_", i++), b, submap, interface_and_method);
-			b.CreateBr(combined_block);
-			combined_result->addIncoming(val, dst_table.back());
-			jump_table.push_back(llvm::BlockAddress::get(dst_table.back()));
-		}
-		size_t jump_table_size = jump_table.size();
-		auto llvm_itable = make_const_array(prefix_name, move(jump_table));
-		auto br = builder.CreateIndirectBr(
-			builder.CreateLoad(
+			i_table[vmt_util::perfect_hash_index(ord.first, hash)] = llvm::ConstantExpr::getBitCast(ord.second, ptr_type);
+		if (i_table_stats) {
+			i_table_stats->tables++;
+			i_table_stats->slots += i_table.size();
+			i_table_stats->max_slots = std::max(i_table_stats->max_slots, i_table.size());
+		}
+		auto llvm_itable = make_const_array(prefix_name, move(i_table));
+		return builder.CreateLoad(
+			ptr_type,
+			builder.CreateGEP(
 				ptr_type,
-				builder.CreateGEP(
-					ptr_type,
-					llvm_itable,
-					{ current_interface_index })),
-			jump_table_size);
-		for (auto& d : dst_table)
-			br->addDestination(d);
-		return combined_result;
+				llvm_itable,
+				builder.CreateLShr(
+					builder.CreateMul(
+						builder.CreateLShr(interface_and_method, builder.getInt64(16)),
+						builder.getInt64(hash.multiplier)),
+					builder.getInt64(64 - hash.width))));
 	}
 
 	llvm::orc::ThreadSafeModule build() {
@@ -2733,6 +2945,8 @@ struct Generator : ast::ActionScanner {
 			ast->own_array,
 			ast->weak_array,
 			ast->string_cls,
+			ast->modules["sys"]->peek_class("Map"),
+			ast->modules["sys"]->peek_class("WeakMap"),
 			ast->modules["sys"]->peek_class("Thread")};
 		dispatcher_fn_type = llvm::FunctionType::get(ptr_type, { int_type }, false);
 		auto dispose_fn_type = llvm::FunctionType::get(void_type, { ptr_type }, false);
@@ -2882,6 +3096,40 @@ struct Generator : ast::ActionScanner {
 					ast::format_str("ag_fn_", m.first, "_", fn.first), module.get())});
 			}
 		}
+		// Declare dispatchers and methods ahead, so direct calls could reference them.
+		for (auto& cls : ast->classes_in_order) {
+			if (cls->is_interface)
+				continue;
+			auto& info = classes[cls];
+			info.dispatcher = llvm::Function::Create(dispatcher_fn_type, llvm::Function::InternalLinkage,
+				ast::format_str("ag_disp_", cls->get_name()), module.get());
+			for (auto& m : cls->new_methods) {
+				declare_function(*m,
+					ast::format_str("ag_m_", cls->get_name(), '_', ast::LongName{ m->name, m->base_module }),
+					m->is_platform);
+			}
+			if (cls->base_class) {
+				for (auto& m : cls->overloads[cls->base_class]) {
+					declare_function(*m,
+						ast::format_str("ag_m_", cls->get_name(), '_', ast::LongName{ m->name, m->base_module }),
+						m->is_platform);
+				}
+			}
+			for (auto& i : cls->interface_vmts) {
+				interface_implementors[i.first].push_back(cls);
+				for (auto& m : i.second) {
+					declare_function(*m.pinned(),
+						ast::format_str("ag_m_", cls->get_name(), '_', i.first->get_name(), '_', ast::LongName{ m->name, m->base_module }),
+						m->is_platform);
+				}
+			}
+			for (auto& b : cls->overloads) {
+				for (auto& m : b.second) {
+					for (auto base = cls->base_class.pinned(); base; base = base->get_implementation()->base_class.pinned())
+						overridden_below[base->get_implementation()].insert(m->name);
+				}
+			}
+		}
 		// From this point it is possible to build code that access fleds and methods.
 		// Make llvm functions for standalone ast functions.
 		// Build class contents - initializer, dispatcher, disposer, copier, methods.
@@ -2897,8 +3145,6 @@ struct Generator : ast::ActionScanner {
 					: llvm::Function::ExternalLinkage,
 				ast::format_str("ag_dtor_", cls->module->name, "_", cls->name), module.get());
 			auto disp_name = ast::format_str("ag_disp_", cls->get_name());
-			info.dispatcher = llvm::Function::Create(dispatcher_fn_type, llvm::Function::InternalLinkage,
-				disp_name, module.get());
 			if (di_builder) {
 				info.dispatcher->setSubprogram(
 					di_builder->createFunction(
@@ -3183,37 +3429,286 @@ struct Generator : ast::ActionScanner {
 	}
 };
 
-llvm::orc::ThreadSafeModule generate_code(ltm::pin<ast::Ast> ast, bool add_debug_info) {
+llvm::orc::ThreadSafeModule generate_code(ltm::pin<ast::Ast> ast, bool add_debug_info, ITableStats* i_table_stats) {
 	Generator gen(ast, add_debug_info);
+	gen.i_table_stats = i_table_stats;
 	return gen.build();
 }
 
-int64_t execute(llvm::orc::ThreadSafeModule& module, ast::Ast& ast, bool dump_ir) {
-#ifdef AG_STANDALONE_COMPILER_MODE
-	return -1;
-#else
-	if (dump_ir) {
-		module.withModuleDo([](llvm::Module& m) {
-			m.print(llvm::outs(), nullptr);
+void optimize_module(llvm::Module& module, char opt_level, llvm::TargetMachine* target_machine) {
+	auto level =
+		opt_level == '1' ? llvm::OptimizationLevel::O1 :
+		opt_level == '2' ? llvm::OptimizationLevel::O2 :
+		opt_level == '3' ? llvm::OptimizationLevel::O3 :
+		opt_level == 's' ? llvm::OptimizationLevel::Os :
+		llvm::OptimizationLevel::O0;
+	if (target_machine) {
+		module.setDataLayout(target_machine->createDataLayout());
+		module.setTargetTriple(target_machine->getTargetTriple().str());
+	}
+	llvm::LoopAnalysisManager lam;
+	llvm::FunctionAnalysisManager fam;
+	llvm::CGSCCAnalysisManager cgam;
+	llvm::ModuleAnalysisManager mam;
+	llvm::PassBuilder builder(target_machine);
+	builder.registerModuleAnalyses(mam);
+	builder.registerCGSCCAnalyses(cgam);
+	builder.registerFunctionAnalyses(fam);
+	builder.registerLoopAnalyses(lam);
+	builder.crossRegisterProxies(lam, fam, cgam, mam);
+	auto pipeline = level == llvm::OptimizationLevel::O0
+		? builder.buildO0DefaultPipeline(level)
+		: builder.buildPerModuleDefaultPipeline(level);
+	pipeline.run(module, mam);
+}
+
+void link_runtime_bitcode(llvm::Module& module, const std::string& bitcode_file_name) {
+	// Runtime functions which bodies are inlined into generated code. All other runtime content
+	// stays in the runtime library, so generated code and the library share the same state.
+	static const char* inlined[] = {
+		"ag_retain_own", "ag_retain_weak", "ag_retain_shared",
+		"ag_release_pin", "ag_release_own", "ag_release_shared", "ag_release_weak",
+		"ag_set_parent" };
+	auto buffer = llvm::MemoryBuffer::getFile(bitcode_file_name);
+	if (!buffer) {
+		llvm::errs() << "Can't read runtime bitcode " << bitcode_file_name << ": " << buffer.getError().message() << "\n";
+		throw 1;
+	}
+	auto runtime = llvm::parseBitcodeFile(buffer.get()->getMemBufferRef(), module.getContext());
+	if (!runtime) {
+		llvm::errs() << "Can't parse runtime bitcode " << bitcode_file_name << ": " << llvm::toString(runtime.takeError()) << "\n";
+		throw 1;
+	}
+	runtime.get()->setDataLayout(module.getDataLayout());
+	runtime.get()->setTargetTriple(module.getTargetTriple());
+	unordered_set<string> runtime_defs;
+	for (auto& f : runtime.get()->functions()) {
+		if (!f.isDeclaration() && !f.hasLocalLinkage())
+			runtime_defs.insert(f.getName().str());
+	}
+	for (auto& g : runtime.get()->globals()) {
+		if (!g.isDeclaration() && !g.hasLocalLinkage())
+			runtime_defs.insert(g.getName().str());
+	}
+	if (llvm::Linker::linkModules(module, move(runtime.get()), llvm::Linker::Flags::LinkOnlyNeeded)) {
+		llvm::errs() << "Can't link runtime bitcode " << bitcode_file_name << "\n";
+		throw 1;
+	}
+	for (auto& f : module.functions()) {
+		if (f.isDeclaration() || !runtime_defs.count(f.getName().str()))
+			continue;
+		if (std::find_if(std::begin(inlined), std::end(inlined), [&](auto n) { return f.getName() == n; }) == std::end(inlined)) {
+			f.deleteBody();
+		} else {
+			f.setLinkage(llvm::GlobalValue::AvailableExternallyLinkage);
+			f.addFnAttr(llvm::Attribute::AlwaysInline);
+		}
+	}
+	for (auto& g : module.globals()) {
+		if (!g.isDeclaration() && runtime_defs.count(g.getName().str())) {
+			g.setInitializer(nullptr);
+			g.setLinkage(llvm::GlobalValue::ExternalLinkage);
+		}
+	}
+}
+
+namespace {
+
+// Source module of the generated function or global by its name: "ag_<kind>_<module>_..." or "L_<module>_...".
+// Argentum identifiers have no '_', so the module name is always a whole name part.
+string source_module_of(llvm::StringRef name, const ast::Ast& ast) {
+	llvm::SmallVector<llvm::StringRef, 4> parts;
+	name.split(parts, '_', 3);
+	llvm::StringRef module_name =
+		parts.size() >= 3 && parts[0] == "ag" ? parts[2] :
+		parts.size() >= 2 && parts[0] == "L" ? parts[1] :
+		"";
+	return ast.modules.count(module_name.str()) ? module_name.str() : "";
+}
+
+// Locals that can be copied to each part that uses them, because nobody relies on their addresses.
+bool is_replicated_in_parts(const llvm::GlobalValue& gv) {
+	if (gv.hasAvailableExternallyLinkage())
+		return true;
+	if (!gv.hasLocalLinkage())
+		return false;
+	if (auto as_var = llvm::dyn_cast<llvm::GlobalVariable>(&gv))
+		return as_var->isConstant() && as_var->hasGlobalUnnamedAddr();
+	return llvm::isa<llvm::Function>(gv);
+}
+
+}  // namespace
+
+std::vector<std::pair<string, std::unique_ptr<llvm::Module>>> split_by_source_modules(llvm::Module& module, ltm::pin<ast::Ast> ast) {
+	unordered_map<const llvm::GlobalValue*, string> owners;
+	std::map<string, size_t> part_sizes;  // ordered for deterministic output
+	for (auto& gv : module.global_values()) {
+		if (gv.isDeclaration() || gv.hasAvailableExternallyLinkage())
+			continue;
+		auto owner = source_module_of(gv.getName(), *ast);
+		if (owner.empty() && is_replicated_in_parts(gv))
+			continue;
+		if (gv.hasLocalLinkage()) {
+			if (!gv.hasName())
+				gv.setName("ag_local");
+			gv.setLinkage(llvm::GlobalValue::ExternalLinkage);
+			gv.setVisibility(llvm::GlobalValue::HiddenVisibility);
+		}
+		part_sizes[owner]++;
+		owners.insert({ &gv, move(owner) });
+	}
+	std::vector<std::pair<string, std::unique_ptr<llvm::Module>>> r;
+	for (auto& part : part_sizes) {
+		llvm::ValueToValueMapTy value_map;
+		auto part_module = llvm::CloneModule(module, value_map, [&](const llvm::GlobalValue* gv) {
+			auto it = owners.find(gv);
+			return it == owners.end()
+				? is_replicated_in_parts(*gv)
+				: it->second == part.first;
 		});
+		part_module->setModuleIdentifier(part.first.empty() ? "ag_shared" : part.first);
+		// Drop replicated locals and declarations not used by this part, so it doesn't change on unrelated edits.
+		for (vector<llvm::GlobalValue*> unused;; unused.clear()) {
+			for (auto& gv : part_module->global_values()) {
+				if (gv.use_empty() && (gv.isDeclaration() || is_replicated_in_parts(gv)))
+					unused.push_back(&gv);
+			}
+			if (unused.empty())
+				break;
+			for (auto gv : unused)
+				gv->eraseFromParent();
+		}
+		r.push_back({ part.first, move(part_module) });
 	}
+	return r;
+}
+
+uint64_t module_content_hash(const llvm::Module& module) {
+	vector<string> items;
+	for (auto& gv : module.global_values()) {
+		string item;
+		llvm::raw_string_ostream out(item);
+		gv.print(out);
+		if (auto as_fn = llvm::dyn_cast<llvm::Function>(&gv))
+			as_fn->getAttributes().print(out);  // `print` refers to attribute groups by number only
+		items.push_back(move(out.str()));
+	}
+	std::sort(items.begin(), items.end());  // the order of globals may depend on hash maps iteration
+	uint64_t r = 0;
+	for (auto& i : items)
+		r = llvm::xxHash64(i) ^ (r * 0x9e3779b97f4a7c15);
+	return r;
+}
+
+std::string compiler_build_id() {
+	static const std::string id = [] {
+		auto exe = llvm::sys::fs::getMainExecutable(nullptr, (void*)&compiler_build_id);
+		if (auto content = llvm::MemoryBuffer::getFile(exe))
+			return llvm::utohexstr(llvm::xxHash64((*content)->getBuffer()));
+		std::random_device rnd;  // unknown build, nothing cached can be reused
+		return ast::format_str("unknown-", rnd(), '-', rnd());
+	}();
+	return id;
+}
+
+#ifndef AG_STANDALONE_COMPILER_MODE
+
+namespace {
+
+// Stores objects compiled by JIT in `dir`, file names are hashes of the program key, compiler build and module name.
+struct DiskObjectCache : llvm::ObjectCache {
+	std::string dir;
+	std::string key;
+
+	DiskObjectCache(const JitCache& cache, char opt_level)
+		: dir(cache.dir)
+		, key(ast::format_str(cache.key, ' ', compiler_build_id(), ' ', LLVM_VERSION_STRING, ' ', int(opt_level))) {}
+
+	std::string file_name(llvm::StringRef module_name) {
+		return ast::format_str(dir, "/", llvm::utohexstr(llvm::xxHash64(ast::format_str(key, ' ', module_name.str()))), ".o");
+	}
+	void notifyObjectCompiled(const llvm::Module* m, llvm::MemoryBufferRef obj) override {
+		if (llvm::sys::fs::create_directories(dir))
+			return;
+		auto name = file_name(m->getModuleIdentifier());
+		auto tmp_name = name + ".tmp";  // other process can read the cache at the same time
+		{
+			std::error_code err;
+			llvm::raw_fd_ostream f(tmp_name, err, llvm::sys::fs::OF_None);
+			if (err)
+				return;
+			f << obj.getBuffer();
+		}
+		if (llvm::sys::fs::rename(tmp_name, name))
+			llvm::sys::fs::remove(tmp_name);
+	}
+	std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module* m) override {
+		return load(m->getModuleIdentifier());
+	}
+	std::unique_ptr<llvm::MemoryBuffer> load(llvm::StringRef module_name) {
+		auto buffer = llvm::MemoryBuffer::getFile(file_name(module_name));
+		return buffer ? std::move(*buffer) : nullptr;
+	}
+};
+
+std::unique_ptr<llvm::orc::LLJIT> make_jit(ast::Ast& ast, char opt_level, int lazy_threads, DiskObjectCache* cache) {
 	llvm::ExitOnError check;
 	llvm::InitializeNativeTarget();
 	llvm::InitializeNativeTargetAsmPrinter();
-	auto jit = check(llvm::orc::LLJITBuilder().create());
+	std::unique_ptr<llvm::orc::LLJIT> jit;
+	if (lazy_threads < 0) {
+		llvm::orc::LLJITBuilder builder;
+		if (cache) {
+			builder.setCompileFunctionCreator([cache](llvm::orc::JITTargetMachineBuilder jtmb)
+				-> llvm::Expected<std::unique_ptr<llvm::orc::IRCompileLayer::IRCompiler>>
+			{
+				return std::make_unique<llvm::orc::ConcurrentIRCompiler>(std::move(jtmb), cache);
+			});
+		}
+		jit = check(builder.create());
+	} else {
+		// Each function is extracted to its own module and compiled on the first call to its stub.
+		llvm::orc::LLLazyJITBuilder builder;
+		builder.setNumCompileThreads(lazy_threads);
+		auto lazy_jit = check(builder.create());
+		if (opt_level) {
+			auto host = check(llvm::orc::JITTargetMachineBuilder::detectHost());
+			lazy_jit->getIRTransformLayer().setTransform(
+				[opt_level, host](llvm::orc::ThreadSafeModule tsm, llvm::orc::MaterializationResponsibility&) -> llvm::Expected<llvm::orc::ThreadSafeModule> {
+					// Transform runs for every extracted function, each compile thread makes its target machine once.
+					thread_local std::unique_ptr<llvm::TargetMachine> tm;
+					if (!tm) {
+						auto jtmb = host;
+						auto created = jtmb.createTargetMachine();
+						if (!created)
+							return created.takeError();
+						tm = std::move(*created);
+					}
+					tsm.withModuleDo([&](llvm::Module& m) {
+						optimize_module(m, opt_level, tm.get());
+					});
+					return std::move(tsm);
+				});
+		}
+		jit = std::move(lazy_jit);
+	}
 	auto& es = jit->getExecutionSession();
 	auto* lib = es.getJITDylibByName("main");
 	llvm::orc::SymbolMap runtime_exports;
 	for (auto& i : ast.platform_exports)
 		runtime_exports.insert({ es.intern(i.first), { llvm::pointerToJITTargetAddress(i.second), llvm::JITSymbolFlags::Callable} });
 	check(lib->define(llvm::orc::absoluteSymbols(move(runtime_exports))));
-	check(jit->addIRModule(std::move(module)));
-	auto f_main = check(jit->lookup("main"));
+	return jit;
+}
+
+int64_t run_jit(llvm::orc::LLJIT& jit, ast::Ast& ast) {
+	llvm::ExitOnError check;
+	auto f_main = check(jit.lookup("main"));
 	auto main_addr = f_main.toPtr<void()>();
 	for (auto& m : ast.modules) {
 		for (auto& test : m.second->tests) {
 			std::cout << "Test:" << m.first << "_" << test.first << "\n";
-			auto test_fn = check(jit->lookup(ast::format_str("ag_test_", m.first, "_", test.first)));
+			auto test_fn = check(jit.lookup(ast::format_str("ag_test_", m.first, "_", test.first)));
 			auto addr = test_fn.toPtr<void()>();
 			addr();
 			assert(ag_leak_detector_ok());
@@ -3223,6 +3718,39 @@ int64_t execute(llvm::orc::ThreadSafeModule& module, ast::Ast& ast, bool dump_ir
 	main_addr();
 	assert(ag_leak_detector_ok());
 	return 0;
+}
+
+const char* code_module_name = "code";  // see Generator::Generator
+
+}  // namespace
+
+#endif
+
+int64_t execute(llvm::orc::ThreadSafeModule& module, ast::Ast& ast, bool dump_ir, char opt_level, int lazy_threads, const JitCache* cache) {
+#ifdef AG_STANDALONE_COMPILER_MODE
+	return -1;
+#else
+	llvm::ExitOnError check;
+	std::unique_ptr<DiskObjectCache> object_cache;
+	if (cache && !cache->dir.empty() && lazy_threads < 0)  // lazy mode compiles functions in modules having no stable names
+		object_cache = std::make_unique<DiskObjectCache>(*cache, opt_level);
+	auto jit = make_jit(ast, opt_level, lazy_threads, object_cache.get());
+	if (opt_level && lazy_threads < 0) {
+		auto target_machine = check(check(llvm::orc::JITTargetMachineBuilder::detectHost()).createTargetMachine());
+		module.withModuleDo([&](llvm::Module& m) {
+			optimize_module(m, opt_level, target_machine.get());
+		});
+	}
+	if (dump_ir) {
+		module.withModuleDo([](llvm::Module& m) {
+			m.print(llvm::outs(), nullptr);
+		});
+	}
+	if (lazy_threads < 0)
+		check(jit->addIRModule(std::move(module)));
+	else
+		check(static_cast<llvm::orc::LLLazyJIT&>(*jit).addLazyIRModule(std::move(module)));
+	return run_jit(*jit, ast);
 #endif
 }
 
@@ -3231,10 +3759,33 @@ static const char* arg = "";
 static const char** argv = &arg;
 static int argc = 0;
 
-int64_t generate_and_execute(ltm::pin<ast::Ast> ast, bool add_debug_info, bool dump_ir) {
+int64_t generate_and_execute(ltm::pin<ast::Ast> ast, bool add_debug_info, bool dump_ir, char opt_level, int lazy_threads, const JitCache* cache) {
 	if (!llvm_inited)
 		llvm::InitLLVM X(argc, argv);
 	llvm_inited = true;
 	auto module = generate_code(ast, add_debug_info);
-	return execute(module, *ast, dump_ir);
+	return execute(module, *ast, dump_ir, opt_level, lazy_threads, cache);
+}
+
+bool execute_cached(ltm::pin<ast::Ast> ast, const JitCache& cache, char opt_level, int64_t& result) {
+#ifdef AG_STANDALONE_COMPILER_MODE
+	return false;
+#else
+	if (cache.dir.empty())
+		return false;
+	DiskObjectCache object_cache(cache, opt_level);
+	auto object = object_cache.load(code_module_name);
+	if (!object)
+		return false;
+	if (!llvm_inited)
+		llvm::InitLLVM X(argc, argv);
+	llvm_inited = true;
+	auto jit = make_jit(*ast, opt_level, -1, nullptr);
+	if (auto err = jit->addObjectFile(std::move(object))) {
+		llvm::consumeError(std::move(err));
+		return false;
+	}
+	result = run_jit(*jit, *ast);
+	return true;
+#endif
 }
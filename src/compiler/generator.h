@@ -3,11 +3,57 @@
 
 #include "compiler/ast.h"
 #include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/Target/TargetMachine.h"
 
-llvm::orc::ThreadSafeModule generate_code(ltm::pin<ast::Ast> ast, bool add_debug_info);
+// Interface dispatch tables built by `generate_code`.
+struct ITableStats {
+	size_t classes = 0;     // dispatchers built
+	size_t interfaces = 0;  // total interfaces implemented by all classes
+	size_t tables = 0;      // classes having 2+ interfaces, that need hashed tables
+	size_t slots = 0;       // total entries in hashed tables
+	size_t max_slots = 0;
+};
+
+llvm::orc::ThreadSafeModule generate_code(ltm::pin<ast::Ast> ast, bool add_debug_info, ITableStats* i_table_stats = nullptr);
+
+// Runs the LLVM module pass pipeline of the given `-O` level: '0', '1', '2', '3' or 's'.
+// `target_machine` (if any) provides data layout and cost model to the passes.
+void optimize_module(llvm::Module& module, char opt_level, llvm::TargetMachine* target_machine = nullptr);
+
+// Links hot runtime functions (retain/release family) from the runtime bitcode file
+// as `available_externally` + `alwaysinline` definitions. Everything else remains external
+// and resolves to `ag_runtime` library at link time. AOT only: in JIT mode runtime is a host part.
+void link_runtime_bitcode(llvm::Module& module, const std::string& bitcode_file_name);
+
+// Splits the whole program module into parts, each holding definitions of one source module.
+// The part named "" holds the rest: `main`, helpers, tables of class instances etc.
+// Internal functions and `unnamed_addr` constants that don't belong to any source module are copied into each part using them,
+// other internal definitions become hidden external ones, so parts can be compiled separately and linked together.
+std::vector<std::pair<std::string, std::unique_ptr<llvm::Module>>> split_by_source_modules(llvm::Module& module, ltm::pin<ast::Ast> ast);
+
+// Hash of module content that doesn't depend on the order of its functions and globals.
+uint64_t module_content_hash(const llvm::Module& module);
 
 int64_t execute(llvm::orc::ThreadSafeModule module, bool dump_ir = false);
 
-int64_t generate_and_execute(ltm::pin<ast::Ast> ast, bool add_debug_info, bool dump_ir);  // used without import in `compiler-test.cpp`
+// Hash of the running compiler executable, computed once. Cached code is valid only for the build that produced it.
+std::string compiler_build_id();
+
+// On-disk cache of JIT-compiled machine code.
+// `key` must identify the program sources, compiler build, LLVM version and opt_level are added to it internally.
+struct JitCache {
+	std::string dir;  // empty - no caching
+	std::string key;
+};
+
+// opt_level: 0 - don't optimize IR, otherwise '0', '1', '2', '3' or 's'
+// lazy_threads: <0 - compile the whole module before start,
+//    otherwise compile each function on its first call using a pool of `lazy_threads` threads (0 - in the calling thread).
+//    Lazy mode optimizes functions one by one, so there is no cross-function inlining. It doesn't use `cache`.
+int64_t generate_and_execute(ltm::pin<ast::Ast> ast, bool add_debug_info, bool dump_ir, char opt_level = 0, int lazy_threads = -1, const JitCache* cache = nullptr);  // used without import in `compiler-test.cpp`
+
+// Runs the program from the cache filled by eager `generate_and_execute`. Only parsed `ast` is needed to find tests.
+// Returns false if there is no cached code.
+bool execute_cached(ltm::pin<ast::Ast> ast, const JitCache& cache, char opt_level, int64_t& result);
 
 #endif  // _AK_GENERATOR_H_
@@ -0,0 +1,78 @@
+#include <cstdlib>
+#include <unordered_map>
+#include "utils/fake-gunit.h"
+#include "compiler/ast.h"
+#include "compiler/parser.h"
+#include "compiler/name-resolver.h"
+#include "compiler/type-checker.h"
+#include "compiler/const-capture-pass.h"
+#include "compiler/escape-pass.h"
+#include "compiler/generator.h"
+
+// M:N mode is switched on by the first `sys_Thread.start` and stays for the whole process,
+// so these tests live in their own binary, which enables it for all of them.
+
+namespace {
+
+using std::unordered_map;
+using std::string;
+using std::move;
+using ltm::own;
+using ast::Ast;
+
+void execute(const char* source_text) {
+#ifdef _WIN32
+    _putenv_s("AG_WORKERS", "1");
+#else
+    setenv("AG_WORKERS", "1", 1);
+#endif
+    ast::initialize();
+    auto ast = own<Ast>::make();
+    auto start_module_name = "akTest";
+    unordered_map<string, string> texts{ {start_module_name, source_text} };
+    parse(ast, start_module_name, [&](string name) {
+        return move(texts[name]);
+    });
+    resolve_names(ast);
+    check_types(ast);
+    const_capture_pass(ast);
+    escape_pass(ast);
+    generate_and_execute(ast, false, false);
+}
+
+// A single worker has nobody to steal from it, so threads `a` and `b` bouncing messages must not starve `late`.
+TEST(PooledThreads, PingPongDoesntStarveOthers) {
+    execute(R"-(
+        class Pinger {
+            peer = &sys_Object;
+            ping(n int, done &()) {
+                n == 0 ? done~();
+                n > 0 ? peer.&pong(m int, d &()) { this~Pinger ? _.ping(m, d) }~(n - 1, done);
+            }
+        }
+        class App {
+            a = sys_Thread(Pinger).start(Pinger);
+            b = sys_Thread(Pinger).start(Pinger);
+            late = sys_Thread(sys_Object).start(sys_Object);
+            step = 0;
+        }
+        app = App;
+        sys_setMainObject(app);
+        app.a.root().&linkA(p &sys_Object) { this~Pinger ? _.peer := p }~(app.b.root());
+        app.b.root().&linkB(p &sys_Object) { this~Pinger ? _.peer := p }~(app.a.root());
+        app.a.root().&start(n int, onStarted &(), done &()) {
+            onStarted~();
+            this~Pinger ? _.ping(n, done)
+        }~(100000, app.&onStarted() {
+            late.root().&lateTask(then &()) { then~() }~(this.&onLate() {
+                sys_assert(0, step);
+                step := 1
+            })
+        }, app.&onDone() {
+            sys_assert(1, step);
+            sys_setMainObject(?sys_Object)
+        });
+    )-");
+}
+
+}  // namespace
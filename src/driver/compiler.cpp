@@ -2,6 +2,8 @@
 #include <fstream>
 #include <optional>
 #include <string>
+#include <functional>
+#include <memory>
 
 #include "llvm/IR/Module.h"
 #include "llvm/IR/LegacyPassManager.h"
@@ -17,11 +19,24 @@
 #include "llvm/Support/Host.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/MC/SubtargetFeature.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Object/ArchiveWriter.h"
+#include "llvm/CodeGen/ParallelCG.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/xxhash.h"
 #include "compiler/ast.h"
 #include "compiler/parser.h"
 #include "compiler/name-resolver.h"
 #include "compiler/type-checker.h"
 #include "compiler/const-capture-pass.h"
+#include "compiler/escape-pass.h"
 #include "compiler/generator.h"
 #include "utils/register_runtime.h"
 
@@ -29,6 +44,155 @@ using ltm::own;
 using ast::Ast;
 using std::optional;
 using std::string;
+using target_machine_factory_t = std::function<std::unique_ptr<llvm::TargetMachine>()>;
+
+void emit_object_file(llvm::Module& module, llvm::TargetMachine* target_machine, const string& file_name, bool output_asm) {
+    std::error_code err_code;
+    llvm::raw_fd_ostream out_file(file_name, err_code, llvm::sys::fs::OF_None);
+    if (err_code) {
+        llvm::errs() << "Could not write file: " << err_code.message() << "\n";
+        exit(1);
+    }
+    llvm::legacy::PassManager pass_manager;
+    if (target_machine->addPassesToEmitFile(pass_manager, out_file, nullptr, output_asm
+        ? llvm::CGFT_AssemblyFile
+        : llvm::CGFT_ObjectFile)) {
+        llvm::errs() << "llvm can't emit a file of this type for target " << target_machine->getTargetTriple().str() << "\n";
+        exit(1);
+    }
+    pass_manager.run(module);
+    out_file.flush();
+}
+
+void write_library(llvm::ArrayRef<llvm::NewArchiveMember> members, const string& target_triple, const string& file_name) {
+    llvm::Triple triple(target_triple);
+    if (auto err = llvm::writeArchive(
+        file_name,
+        members,
+        true,  // symbol table
+        triple.isOSDarwin() ? llvm::object::Archive::K_DARWIN :
+        triple.isOSWindows() ? llvm::object::Archive::K_COFF :
+        llvm::object::Archive::K_GNU,
+        true,  // deterministic
+        false))  // not thin
+    {
+        llvm::errs() << "Could not write file " << file_name << ": " << llvm::toString(std::move(err)) << "\n";
+        exit(1);
+    }
+}
+
+// Compiles each source module separately and packs the objects in a static library `out_file_name`.
+// Objects are kept in `cache_dir` under names made of the part IR hash, so only parts that changed since
+// the previous build get optimized and compiled again.
+// A part changes if its own code changes or if declarations of things it uses from other parts change.
+// Since the program is generated as a whole, changes in class hierarchy (vmt layouts, interface ids,
+// devirtualized calls) may also affect parts of unchanged modules.
+// Parts are compiled on `threads` threads, each part in its own LLVMContext.
+void build_incrementally(
+    llvm::Module& module,
+    ltm::pin<Ast> ast,
+    const target_machine_factory_t& make_target_machine,
+    char opt_level,
+    unsigned threads,
+    const string& cache_dir,
+    const string& out_file_name)
+{
+    auto target_machine = make_target_machine();
+    if (auto err = llvm::sys::fs::create_directories(cache_dir)) {
+        llvm::errs() << "Could not create directory " << cache_dir << ": " << err.message() << "\n";
+        exit(1);
+    }
+    auto build_key = ast::format_str(
+        module.getTargetTriple(), ' ',
+        target_machine->getTargetCPU().str(), ' ',
+        target_machine->getTargetFeatureString().str(), ' ',
+        opt_level, ' ',
+        compiler_build_id(), ' ', LLVM_VERSION_STRING);
+    std::vector<string> file_names;
+    size_t rebuilt = 0;
+    llvm::ThreadPool pool(llvm::hardware_concurrency(threads));
+    auto parts = split_by_source_modules(module, ast);
+    for (auto& [source_module, part] : parts) {
+        auto prefix = (source_module.empty() ? "ag_shared" : source_module) + "-";
+        auto hash = llvm::xxHash64(build_key + llvm::utohexstr(module_content_hash(*part)));
+        llvm::SmallString<128> file_name(cache_dir);
+        llvm::sys::path::append(file_name, prefix + llvm::utohexstr(hash) + ".o");
+        file_names.push_back(file_name.str().str());
+        if (llvm::sys::fs::exists(file_name))
+            continue;
+        rebuilt++;
+        // Remove stale objects of this part.
+        std::error_code err;
+        for (llvm::sys::fs::directory_iterator it(cache_dir, err), end; it != end && !err; it.increment(err)) {
+            auto entry_name = llvm::sys::path::filename(it->path());
+            if (entry_name.startswith(prefix) && entry_name.endswith(".o"))
+                llvm::sys::fs::remove(it->path());
+        }
+        // LLVMContext is single threaded, so the part is passed to its thread as bitcode.
+        auto bitcode = std::make_shared<llvm::SmallVector<char, 0>>();
+        llvm::raw_svector_ostream bitcode_stream(*bitcode);
+        llvm::WriteBitcodeToFile(*part, bitcode_stream);
+        pool.async([&, bitcode, file_name = file_names.back()] {
+            llvm::LLVMContext context;
+            auto part = llvm::parseBitcodeFile(llvm::MemoryBufferRef(llvm::StringRef(bitcode->data(), bitcode->size()), file_name), context);
+            if (!part) {
+                llvm::errs() << "internal error in part " << file_name << ": " << llvm::toString(part.takeError()) << "\n";
+                exit(1);
+            }
+            auto target_machine = make_target_machine();
+            if (opt_level)
+                optimize_module(**part, opt_level, target_machine.get());
+            auto tmp_name = file_name + ".tmp";
+            emit_object_file(**part, target_machine.get(), tmp_name, false);
+            if (auto err = llvm::sys::fs::rename(tmp_name, file_name)) {
+                llvm::errs() << "Could not write file " << file_name << ": " << err.message() << "\n";
+                exit(1);
+            }
+        });
+    }
+    pool.wait();
+    std::vector<llvm::NewArchiveMember> members;
+    for (auto& file_name : file_names) {
+        auto member = llvm::NewArchiveMember::getFile(file_name, true);  // deterministic
+        if (!member) {
+            llvm::errs() << "Could not read file " << file_name << ": " << llvm::toString(member.takeError()) << "\n";
+            exit(1);
+        }
+        members.push_back(std::move(*member));
+    }
+    write_library(members, module.getTargetTriple(), out_file_name);
+    llvm::outs() << "Compiled " << rebuilt << " of " << parts.size() << " parts\n";
+}
+
+// Optimizes the whole `module`, then splits it in `threads` parts and compiles them in parallel
+// to the static library `out_file_name`.
+void build_in_parallel(
+    llvm::Module& module,
+    const target_machine_factory_t& make_target_machine,
+    char opt_level,
+    unsigned threads,
+    const string& out_file_name)
+{
+    if (opt_level)
+        optimize_module(module, opt_level, make_target_machine().get());
+    std::vector<llvm::SmallVector<char, 0>> objects(threads);
+    std::vector<std::unique_ptr<llvm::raw_svector_ostream>> streams;
+    std::vector<llvm::raw_pwrite_stream*> stream_ptrs;
+    for (auto& obj : objects) {
+        streams.push_back(std::make_unique<llvm::raw_svector_ostream>(obj));
+        stream_ptrs.push_back(streams.back().get());
+    }
+    llvm::splitCodeGen(module, stream_ptrs, {}, make_target_machine, llvm::CGFT_ObjectFile);
+    std::vector<llvm::NewArchiveMember> members;
+    for (size_t i = 0; i < objects.size(); i++) {
+        if (objects[i].empty())  // fewer partitions than threads
+            continue;
+        members.emplace_back(llvm::MemoryBufferRef(
+            llvm::StringRef(objects[i].data(), objects[i].size()),
+            ast::format_str("part", i, ".o")));
+    }
+    write_library(members, module.getTargetTriple(), out_file_name);
+}
 
 std::string read_file(std::string file_name) {
     std::ifstream f(file_name, std::ios::binary | std::ios::ate);
@@ -57,7 +221,13 @@ int main(int argc, char* argv[]) {
         bool output_bitcode = false;
         bool output_asm = false;
         bool add_debug_info = false;
-        string src_dir_name, start_module_name, out_file_name;
+        bool print_i_table_stats = false;
+        string incremental_dir;
+        unsigned threads = 1;
+        char opt_level = 0;  // 0 - not specified
+        string src_dir_name, start_module_name, out_file_name, runtime_bitcode_name;
+        string cpu = "generic";
+        string features;  // comma separated +feature/-feature list
         for (auto arg = argv + 1, end = argv + argc; arg != end; arg++) {
             auto param = [&] {
                 if (++arg == end) {
@@ -75,7 +245,19 @@ int main(int argc, char* argv[]) {
                     "  -target <arch><sub>-<vendor>-<sys>-<abi>\n"
                     "          Example: x86_64-unknown-linux-gnu\n"
                     "                or x86_64-w64-microsoft-windows\n"
+                    "  -mcpu=name : target cpu, for example: skylake-avx512, znver3\n"
+                    "  -mattr=+f1,-f2 : enable/disable target features, for example: +avx2,+bmi2\n"
+                    "  -march=native : use cpu and features of this machine\n"
                     "  -g : generate debug info\n"
+                    "  -O0 -O1 -O2 -O3 -Os : optimization level\n"
+                    "  -runtime-bc file : inline retain/release from runtime bitcode (ag_runtime.bc)\n"
+                    "  -itable-stats : print interface dispatch table sizes\n"
+                    "  -incremental dir : compile modules separately and keep their objects in dir,\n"
+                    "          recompile only changed ones, out_file is a static library then.\n"
+                    "          No cross-module inlining in this mode.\n"
+                    "  -j threads : compile in parallel, out_file is a static library if threads > 1.\n"
+                    "          With -incremental modules are compiled in parallel,\n"
+                    "          otherwise the optimized program is split in `threads` parts.\n"
                     "  -emit-llvm : output bitcode\n"
                     "  -S         : output asm file\n";
                 return 0;
@@ -83,8 +265,34 @@ int main(int argc, char* argv[]) {
                 output_asm = true;
             } else if (strcmp(*arg, "-emit-llvm") == 0) {
                 output_bitcode = true;
+            } else if (strncmp(*arg, "-mcpu=", 6) == 0) {
+                cpu = *arg + 6;
+            } else if (strncmp(*arg, "-mattr=", 7) == 0) {
+                features = features.empty() ? string(*arg + 7) : features + "," + (*arg + 7);
+            } else if (strncmp(*arg, "-march=", 7) == 0) {
+                cpu = *arg + 7;
+                if (cpu == "native") {
+                    cpu = llvm::sys::getHostCPUName().str();
+                    llvm::StringMap<bool> host_features;
+                    if (llvm::sys::getHostCPUFeatures(host_features)) {
+                        llvm::SubtargetFeatures f;
+                        for (auto& hf : host_features)
+                            f.AddFeature(hf.first(), hf.second);
+                        features = features.empty() ? f.getString() : f.getString() + "," + features;
+                    }
+                }
             } else if (strcmp(*arg, "-g") == 0) {
                 add_debug_info = true;
+            } else if (strlen(*arg) == 3 && strncmp(*arg, "-O", 2) == 0 && strchr("0123s", (*arg)[2])) {
+                opt_level = (*arg)[2];
+            } else if (strcmp(*arg, "-itable-stats") == 0) {
+                print_i_table_stats = true;
+            } else if (strcmp(*arg, "-j") == 0) {
+                threads = std::max(1, atoi(param()));
+            } else if (strcmp(*arg, "-incremental") == 0) {
+                incremental_dir = param();
+            } else if (strcmp(*arg, "-runtime-bc") == 0) {
+                runtime_bitcode_name = param();
             } else if (strcmp(*arg, "-target") == 0) {
                 target_triple = param();
             } else if (strcmp(*arg, "-o") == 0) {
@@ -107,6 +315,10 @@ int main(int argc, char* argv[]) {
         check_str(src_dir_name, "source directory");
         check_str(start_module_name, "start module");
         check_str(out_file_name, "output file");
+        if ((!incremental_dir.empty() || threads > 1) && (output_asm || output_bitcode || add_debug_info)) {
+            llvm::errs() << "-incremental and -j are not compatible with -S, -emit-llvm and -g\n";
+            exit(1);
+        }
         ast::initialize();
         auto ast = own<Ast>::make();
         ast->absolute_path = src_dir_name;
@@ -117,50 +329,73 @@ int main(int argc, char* argv[]) {
         resolve_names(ast);
         check_types(ast);
         const_capture_pass(ast);
+        escape_pass(ast);
         llvm::InitializeAllTargetInfos();
         llvm::InitializeAllTargets();
         llvm::InitializeAllTargetMCs();
         llvm::InitializeAllAsmPrinters();
-        auto threadsafe_module = generate_code(ast, add_debug_info);
+        ITableStats i_table_stats;
+        auto threadsafe_module = generate_code(ast, add_debug_info, &i_table_stats);
+        if (print_i_table_stats) {
+            llvm::outs() << "Interface tables: " << i_table_stats.classes << " classes, "
+                << i_table_stats.interfaces << " interfaces, "
+                << i_table_stats.tables << " hashed tables, "
+                << i_table_stats.slots << " slots, max "
+                << i_table_stats.max_slots << " slots per class\n";
+        }
         threadsafe_module.withModuleDo([&](llvm::Module& module) {
-            std::error_code err_code;
-            llvm::raw_fd_ostream out_file(out_file_name, err_code, llvm::sys::fs::OF_None);
-            if (err_code) {
-                llvm::errs() << "Could not write file: " << err_code.message() << "\n";
+            module.setTargetTriple(target_triple);
+            std::string error_str;
+            auto target = llvm::TargetRegistry::lookupTarget(target_triple, error_str);
+            if (!target) {
+                llvm::errs() << error_str << "\n";
                 exit(1);
             }
-            module.setTargetTriple(target_triple);
-            if (output_bitcode) {
-                if (output_asm)
-                    module.print(out_file, nullptr);
-                else
-                    llvm::WriteBitcodeToFile(module, out_file);
-            } else {
-                std::string error_str;
-                auto target = llvm::TargetRegistry::lookupTarget(target_triple, error_str);
-                if (!target) {
-                    llvm::errs() << error_str << "\n";
-                    exit(1);
-                }
-                auto target_machine = target->createTargetMachine(
+            auto codegen_opt_level =
+                add_debug_info || opt_level == '0' ? llvm::CodeGenOpt::Level::None :
+                opt_level == '1' ? llvm::CodeGenOpt::Level::Less :
+                opt_level == '3' ? llvm::CodeGenOpt::Level::Aggressive :
+                llvm::CodeGenOpt::Level::Default;
+            target_machine_factory_t make_target_machine = [&] {
+                std::unique_ptr<llvm::TargetMachine> r(target->createTargetMachine(
                     target_triple,
-                    "generic",  // cpu
-                    "",         // features
+                    cpu,
+                    features,
                     llvm::TargetOptions(),
-                    std::optional<llvm::Reloc::Model>());
-                if (add_debug_info)
-                    target_machine->setOptLevel(llvm::CodeGenOpt::Level::None);
-                module.setDataLayout(target_machine->createDataLayout());
-                llvm::legacy::PassManager pass_manager;
-                if (target_machine->addPassesToEmitFile(pass_manager, out_file, nullptr, output_asm
-                    ? llvm::CGFT_AssemblyFile
-                    : llvm::CGFT_ObjectFile)) {
-                    llvm::errs() << "llvm can't emit a file of this type for target " << target_triple << "\n";
-                    exit(1);
+                    std::optional<llvm::Reloc::Model>()));
+                r->setOptLevel(codegen_opt_level);
+                return r;
+            };
+            auto target_machine_holder = make_target_machine();
+            auto target_machine = target_machine_holder.get();
+            module.setDataLayout(target_machine->createDataLayout());
+            if (!runtime_bitcode_name.empty()) {
+                link_runtime_bitcode(module, runtime_bitcode_name);
+                if (!opt_level)
+                    opt_level = '0';  // at least run the always-inliner
+            }
+            if (!incremental_dir.empty()) {
+                build_incrementally(module, ast, make_target_machine, opt_level, threads, incremental_dir, out_file_name);
+            } else if (threads > 1) {
+                build_in_parallel(module, make_target_machine, opt_level, threads, out_file_name);
+            } else {
+                if (opt_level)
+                    optimize_module(module, opt_level, target_machine);
+                if (output_bitcode) {
+                    std::error_code err_code;
+                    llvm::raw_fd_ostream out_file(out_file_name, err_code, llvm::sys::fs::OF_None);
+                    if (err_code) {
+                        llvm::errs() << "Could not write file: " << err_code.message() << "\n";
+                        exit(1);
+                    }
+                    if (output_asm)
+                        module.print(out_file, nullptr);
+                    else
+                        llvm::WriteBitcodeToFile(module, out_file);
+                } else {
+                    emit_object_file(module, target_machine, out_file_name, output_asm);
                 }
-                pass_manager.run(module);
             }
-            out_file.flush();
             llvm::outs() << "Done " << out_file_name << "\n";
         });
 //    } catch (void*) {  // debug-only  TODO: replace exceptions with `quick_exit`
@@ -1,20 +1,25 @@
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <thread>
 
 #include "compiler/ast.h"
 #include "dom/dom-to-string.h"
 #include "compiler/parser.h"
 #include "compiler/name-resolver.h"
 #include "compiler/const-capture-pass.h"
+#include "compiler/escape-pass.h"
 #include "compiler/type-checker.h"
+#include "compiler/generator.h"
 #include "utils/register_runtime.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/xxhash.h"
 
 #include "runtime/runtime.h"
 #include "runtime/sdl-bindings.h"
 
 using ltm::own;
 using ast::Ast;
-int64_t generate_and_execute(ltm::pin<Ast> ast, bool add_debug_info, bool dump_ir);  // defined in `generator.h/cpp`
 
 std::string read_file(std::string file_name) {
     std::ifstream f(file_name, std::ios::binary | std::ios::ate);
@@ -35,13 +40,31 @@ std::string read_file(std::string file_name) {
 int main(int argc, char* argv[]) {
     try {
         if (argc < 3) {
-            std::cout << "Usage: " << argv[0] << " path_to_sources start_module_name" << std::endl;
+            std::cout << "Usage: " << argv[0] << " path_to_sources start_module_name [-O0|-O1|-O2|-O3|-Os] [-lazy[=threads]] [-cache=dir]" << std::endl;
             return 0;
         }
         if (std::string(argv[1]) == "--help") {
             std::cout << "Argentum JIT interpreter demo. Language that makes difference." << std::endl;
             return 0;
         }
+        char opt_level = 0;  // 0 - not specified
+        int lazy_threads = -1;  // compile all before start
+        JitCache cache;
+        for (int i = 3; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg.size() == 3 && arg.compare(0, 2, "-O") == 0 && std::string("0123s").find(arg[2]) != std::string::npos) {
+                opt_level = arg[2];
+            } else if (arg == "-lazy") {
+                lazy_threads = std::max(1u, std::thread::hardware_concurrency());
+            } else if (arg.compare(0, 6, "-lazy=") == 0) {
+                lazy_threads = std::stoi(arg.substr(6));
+            } else if (arg.compare(0, 7, "-cache=") == 0) {
+                cache.dir = arg.substr(7);
+            } else {
+                std::cerr << "unexpected cmdline argument " << arg << std::endl;
+                return -1;
+            }
+        }
         ast::initialize();
         auto ast = own<Ast>::make();
         using FN = void(*)();
@@ -69,16 +92,28 @@ int main(int argc, char* argv[]) {
             FN(ag_fn_sdlFfi_imgLoad),
             FN(ag_fn_sdlFfi_imgQuit) });
         std::cout << "Parsing " << argv[1] << std::endl;
+        std::string sources;  // all module names and texts in parsing order, to make cache key
         parse(ast, argv[2], [&](auto name) {
-            return read_file(ast::format_str(argv[1], "/", name, ".ag"));
+            auto text = read_file(ast::format_str(argv[1], "/", name, ".ag"));
+            sources += name;
+            sources += '\0';
+            sources += text;
+            sources += '\0';
+            return text;
         });
+        cache.key = llvm::utohexstr(llvm::xxHash64(sources));
+        if (int64_t result; lazy_threads < 0 && execute_cached(ast, cache, opt_level, result)) {
+            std::cout << "Executed cached code from " << cache.dir << std::endl;
+            return 0;
+        }
         std::cout << "Checking name consistency" << std::endl;
         resolve_names(ast);
         std::cout << "Checking types" << std::endl;
         check_types(ast);
         std::cout << "Building bitcode" << std::endl;
         const_capture_pass(ast);
-        generate_and_execute(ast, false, false);  // no debug info, no dump
+        escape_pass(ast);
+        generate_and_execute(ast, false, false, opt_level, lazy_threads, &cache);  // no debug info, no dump
 //    } catch (void*) {  // debug-only  TODO: replace exceptions with `quick_exit`
     } catch (int) {
         return -1;
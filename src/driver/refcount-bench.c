@@ -0,0 +1,67 @@
+// Measures throughput of cross-thread (AG_CTR_MT) retain/release operations
+// on one shared object and its weak block, accessed from 1..N threads simultaneously.
+// Usage: ag-refcount-bench [max_threads] [million_ops_per_thread]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <threads.h>
+
+#include "runtime/runtime.h"
+
+static void bench_dispose(void* ptr) {}
+static void bench_visit(void* ptr, void(*visitor)(void*, int, void*), void* ctx) {}
+
+// Fake class: objects' dispatcher points right after AgVmt, it is never called.
+static struct {
+	AgVmt    vmt;
+	uint64_t dispatcher;
+} bench_class = { { NULL, bench_dispose, bench_visit, sizeof(AgObject), sizeof(AgVmt) }, 0 };
+
+static AgObject* shared_obj;
+static AgWeak*   shared_weak;
+static long      ops_per_thread;
+
+static uint64_t now_ns() {
+	struct timespec t;
+	timespec_get(&t, TIME_UTC);
+	return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static int bench_thread_proc(void* unused) {
+	for (long i = ops_per_thread; i; i--) {
+		ag_retain_shared(shared_obj);
+		ag_retain_weak(shared_weak);
+		ag_release_shared(shared_obj);
+		ag_release_weak(shared_weak);
+	}
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+	int max_threads = argc > 1 ? atoi(argv[1]) : 16;
+	ops_per_thread = (argc > 2 ? atol(argv[2]) : 4) * 1000000 / 4;
+	ag_init();
+	shared_obj = ag_allocate_obj(sizeof(AgObject));
+	shared_obj->dispatcher = (void** (*)(uint64_t)) &bench_class.dispatcher;
+	shared_weak = ag_mk_weak(shared_obj);
+	shared_obj->ctr_mt |= AG_CTR_MT;   // as if it was frozen and passed to other threads
+	shared_weak->wb_ctr_mt |= AG_CTR_MT;
+	thrd_t* threads = malloc(sizeof(thrd_t) * max_threads);
+	printf("threads   Mops/s   Mops/s/thread\n");
+	for (int n = 1; n <= max_threads; n *= 2) {
+		uint64_t start = now_ns();
+		for (int i = 0; i < n; i++)
+			thrd_create(&threads[i], bench_thread_proc, NULL);
+		for (int i = 0; i < n; i++) {
+			int unused_result;
+			thrd_join(threads[i], &unused_result);
+		}
+		double mops = (double)n * ops_per_thread * 4 * 1000 / (now_ns() - start);
+		printf("%7d %8.1f %15.1f\n", n, mops, mops / n);
+	}
+	free(threads);
+	ag_release_weak(shared_weak);
+	ag_release_shared(shared_obj);
+	return ag_leak_detector_ok() ? 0 : 1;
+}
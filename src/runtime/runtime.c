@@ -1,3 +1,6 @@
+#if !defined(WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L  // posix_memalign
+#endif
 #include <stddef.h> // size_t
 #include <stdint.h> // int32_t
 #include <stdio.h> // puts
@@ -92,11 +95,59 @@ inline int cnd_wait(cnd_t* cond, mtx_t* mutex) {
 }
 #define AG_THREAD_LOCAL __declspec(thread)
 
+// Atomics
+#define ag_atomic_inc(PTR, VAL) ((uintptr_t)InterlockedAdd64((LONG64 volatile*)(PTR), (LONG64)(VAL)))  // returns new value
+#define ag_atomic_dec(PTR, VAL) ((uintptr_t)InterlockedExchangeAdd64((LONG64 volatile*)(PTR), -(LONG64)(VAL)) - (VAL))  // returns new value
+#define ag_atomic_exchange_ptr(PTR, VAL) InterlockedExchangePointer((PVOID volatile*)(PTR), (VAL))
+#define ag_atomic_exchange_int(PTR, VAL) InterlockedExchange((LONG volatile*)(PTR), (VAL))
+#define ag_atomic_add_int(PTR, VAL) InterlockedAdd((LONG volatile*)(PTR), (VAL))  // returns new value
+#define ag_atomic_load_int(PTR) InterlockedCompareExchange((LONG volatile*)(PTR), 0, 0)
+static inline int ag_ctz(uint32_t v) {
+	unsigned long r;
+	_BitScanForward(&r, v);
+	return (int)r;
+}
+#define ag_prefetch(PTR) PreFetchCacheLine(PF_TEMPORAL_LEVEL_1, (PTR))
+#define ag_atomic_load_ptr(PTR) InterlockedCompareExchangePointer((PVOID volatile*)(PTR), NULL, NULL)
+#define ag_atomic_store_ptr(PTR, VAL) InterlockedExchangePointer((PVOID volatile*)(PTR), (VAL))
+static inline bool ag_atomic_cas_ptr(void* volatile* ptr, void** expected, void* val) {
+	void* prev = InterlockedCompareExchangePointer((PVOID volatile*)ptr, val, *expected);
+	if (prev == *expected)
+		return true;
+	*expected = prev;
+	return false;
+}
+
+// Aligned memory
+#define ag_aligned_alloc(ALIGN, SIZE) _aligned_malloc((SIZE), (ALIGN))
+#define ag_aligned_free _aligned_free
+
 #else
 
 #include <threads.h>
 #define AG_THREAD_LOCAL _Thread_local
 
+// Atomics
+#define ag_atomic_inc(PTR, VAL) __atomic_add_fetch((PTR), (VAL), __ATOMIC_RELAXED)  // returns new value
+#define ag_atomic_dec(PTR, VAL) __atomic_sub_fetch((PTR), (VAL), __ATOMIC_ACQ_REL)  // returns new value
+#define ag_atomic_exchange_ptr(PTR, VAL) __atomic_exchange_n((PTR), (VAL), __ATOMIC_ACQ_REL)
+#define ag_atomic_exchange_int(PTR, VAL) __atomic_exchange_n((PTR), (VAL), __ATOMIC_SEQ_CST)
+#define ag_atomic_add_int(PTR, VAL) __atomic_add_fetch((PTR), (VAL), __ATOMIC_SEQ_CST)  // returns new value
+#define ag_atomic_load_int(PTR) __atomic_load_n((PTR), __ATOMIC_SEQ_CST)
+#define ag_ctz __builtin_ctz
+#define ag_prefetch(PTR) __builtin_prefetch((PTR))
+#define ag_atomic_load_ptr(PTR) __atomic_load_n((PTR), __ATOMIC_ACQUIRE)
+#define ag_atomic_store_ptr(PTR, VAL) __atomic_store_n((PTR), (VAL), __ATOMIC_SEQ_CST)
+#define ag_atomic_cas_ptr(PTR, EXPECTED, VAL) __atomic_compare_exchange_n((PTR), (EXPECTED), (VAL), 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)
+
+// Aligned memory
+#include <stdlib.h>
+static inline void* ag_aligned_alloc(size_t align, size_t size) {
+	void* r = NULL;
+	return posix_memalign(&r, align, size) == 0 ? r : NULL;
+}
+#define ag_aligned_free free
+
 #endif
 
 #ifdef NO_DEFAULT_LIB
@@ -115,8 +166,14 @@ void ag_memmove(void*, void*, size_t);
 
 #ifndef AG_ALLOC
 #include <stdlib.h>
+#ifdef AG_NO_POOL_ALLOCATOR
 #define AG_ALLOC malloc
 #define AG_FREE free
+#else
+#define AG_POOL_ALLOCATOR
+#define AG_ALLOC ag_pool_alloc
+#define AG_FREE ag_pool_free
+#endif
 #endif
 
 #ifndef __cplusplus
@@ -144,6 +201,125 @@ void ag_memmove(void*, void*, size_t);
 
 #define AG_HEAD_SIZE 0
 
+#ifdef AG_POOL_ALLOCATOR
+//
+// Thread-local size-class pool allocator.
+// Memory is taken from the system in slabs aligned to their size, so any block finds its slab header by masking its address.
+// Each slab holds blocks of one size class and belongs to one pool. Pools are bound to threads.
+// Blocks freed on the owning thread go to the local free list, blocks freed on other threads go to
+// the owner's lock-free `remote_free` stack that the owner takes at once when its local free list runs out.
+// Blocks bigger than AG_POOL_MAX_SIZE are allocated from the system one per slab with null owner.
+//
+#define AG_POOL_SLAB_SIZE ((size_t)1 << 16)
+#define AG_POOL_CLASSES   40      // 16 classes of 16..256 bytes step 16, then 4 classes per each power of 2
+#define AG_POOL_MAX_SIZE  16384
+
+typedef struct ag_pool_tag {
+	void*                 free[AG_POOL_CLASSES];     // local free lists
+	char*                 bump[AG_POOL_CLASSES];     // not yet used part of the last slab of class
+	char*                 bump_end[AG_POOL_CLASSES];
+	void* volatile        remote_free;               // blocks freed by other threads
+} ag_pool;
+
+typedef struct {
+	ag_pool* owner;       // null for big blocks
+	size_t   size_class;
+} ag_slab;
+
+AG_THREAD_LOCAL ag_pool* ag_current_pool = NULL;
+
+#define ag_slab_of(PTR) ((ag_slab*)((uintptr_t)(PTR) & ~(AG_POOL_SLAB_SIZE - 1)))
+
+static inline size_t ag_pool_class(size_t size) {
+	if (size <= 256)
+		return size ? (size - 1) >> 4 : 0;
+	size_t s = size - 1;
+	size_t bits = 8;
+	while (s >> (bits + 1))
+		bits++;
+	return 16 + (bits - 8) * 4 + ((s >> (bits - 2)) & 3);
+}
+
+static inline size_t ag_pool_class_size(size_t size_class) {
+	if (size_class < 16)
+		return (size_class + 1) << 4;
+	size_class -= 16;
+	return (5 + (size_class & 3)) << (size_class / 4 + 6);
+}
+
+void ag_pool_free(void* ptr) {
+	if (!ptr)
+		return;
+	ag_slab* slab = ag_slab_of(ptr);
+	ag_pool* pool = slab->owner;
+	if (!pool) {
+		ag_aligned_free(slab);
+	} else if (pool == ag_current_pool) {
+		*(void**)ptr = pool->free[slab->size_class];
+		pool->free[slab->size_class] = ptr;
+	} else {
+		void* head = pool->remote_free;
+		do
+			*(void**)ptr = head;
+		while (!ag_atomic_cas_ptr(&pool->remote_free, &head, ptr));
+	}
+}
+
+static void* ag_pool_alloc_slow(ag_pool* pool, size_t size_class) {
+	size_t size = ag_pool_class_size(size_class);
+	if (pool->bump_end[size_class] - pool->bump[size_class] < (ptrdiff_t)size) {
+		if (pool->remote_free) {
+			void* i = ag_atomic_exchange_ptr(&pool->remote_free, NULL);
+			while (i) {
+				void* next = *(void**)i;
+				size_t c = ag_slab_of(i)->size_class;
+				*(void**)i = pool->free[c];
+				pool->free[c] = i;
+				i = next;
+			}
+			void* r = pool->free[size_class];
+			if (r) {
+				pool->free[size_class] = *(void**)r;
+				return r;
+			}
+		}
+		ag_slab* slab = (ag_slab*)ag_aligned_alloc(AG_POOL_SLAB_SIZE, AG_POOL_SLAB_SIZE);
+		if (!slab)
+			return NULL;
+		slab->owner = pool;
+		slab->size_class = size_class;
+		pool->bump[size_class] = (char*)(slab + 1);
+		pool->bump_end[size_class] = (char*)slab + AG_POOL_SLAB_SIZE;
+	}
+	void* r = pool->bump[size_class];
+	pool->bump[size_class] += size;
+	return r;
+}
+
+void* ag_pool_alloc(size_t size) {
+	if (size > AG_POOL_MAX_SIZE) {
+		ag_slab* slab = (ag_slab*)ag_aligned_alloc(AG_POOL_SLAB_SIZE, sizeof(ag_slab) + size);
+		if (!slab)
+			return NULL;
+		slab->owner = NULL;
+		slab->size_class = 0;
+		return slab + 1;
+	}
+	ag_pool* pool = ag_current_pool;
+	if (!pool) {  // not an ag-thread, its pool is never reclaimed
+		pool = ag_current_pool = (ag_pool*)calloc(1, sizeof(ag_pool));
+		if (!pool)
+			return NULL;
+	}
+	size_t size_class = ag_pool_class(size);
+	void* r = pool->free[size_class];
+	if (!r)
+		return ag_pool_alloc_slow(pool, size_class);
+	pool->free[size_class] = *(void**)r;
+	return r;
+}
+#endif
+
 size_t ag_leak_detector_counter = 0;
 size_t ag_current_allocated = 0;
 size_t ag_max_allocated = 0;
@@ -177,25 +353,59 @@ void ag_free(void* data) {
 
 #endif
 
-#define AG_THREAD_QUEUE_SIZE 8192
+typedef struct ag_message_tag {
+	struct ag_message_tag* volatile next;
+	uint64_t params[3];  // trampoline, receiver_weak, entry_point, followed by message params
+} ag_message;
 
-typedef struct ag_queue_tag {
-	int64_t* start;
-	int64_t* end;
-	int64_t* read_pos;
-	int64_t* write_pos;
+// Intrusive lock-free multi-producer single-consumer queue of messages (D. Vyukov's algorithm)
+typedef struct {
+	ag_message* volatile tail;  // producers push here
+	ag_message*          head;  // consumer pops from here
+	ag_message           stub;
 } ag_queue;
 
+typedef struct {
+	uint64_t at;       // ms, UTC
+	ag_fn    proc;
+	AgWeak*  receiver;
+	size_t   slot;     // index in timer_slots
+} ag_timer;
+
+typedef struct {
+	uint64_t id;       // 0 if slot is free
+	size_t   pos;      // index in timers heap, or next free slot + 1 if slot is free
+} ag_timer_slot;
+
+#define AG_TIMER_SLOT_BITS 24  // timer id = unique_sequence << AG_TIMER_SLOT_BITS | slot_index
+
 typedef struct ag_thread_tag {
-	ag_queue  in;
-	ag_queue  out;
-	AgObject* root;     // 0 if free
-	uint64_t  timer_ms;  // todo: replace with pyramid-heap
-	ag_fn     timer_proc;
-	AgWeak*   timer_proc_param; // next free if free
-	mtx_t     mutex;
-	cnd_t     is_not_empty;
-	thrd_t    thread;
+	ag_queue     in;
+	ag_message*  reading;   // message being read by trampoline
+	uint64_t*    read_pos;
+	volatile int parked;    // 1 if thread is going to sleep on `is_not_empty`, posters must wake it up
+	volatile int closed;    // 1 after thread ended, posters must not push to `in`
+	volatile int posters;   // number of posters that passed the `closed` check and haven't finished their push yet
+	AgObject*    root;      // 0 if free
+	ag_timer*      timers;       // binary min-heap by `at`
+	size_t         timers_count;
+	size_t         timers_alloc;
+	ag_timer_slot* timer_slots;  // maps timer ids to heap positions
+	size_t         timer_slots_count;
+	size_t         timer_slots_alloc;
+	size_t         free_timer_slot;  // head of free slots chain + 1, 0 if none
+	struct ag_thread_tag* next_free;  // in ag_thread_free chain
+	volatile int scheduled; // pooled only: 1 while thread is in a worker's deque or runs on a worker
+	bool         pooled;    // runs on workers pool instead of its own OS thread
+	bool         recycled;  // pooled only: ended and put to ag_thread_free chain
+	uint64_t     wakeup_at; // pooled only: registered wakeup for the earliest timer, guarded by ag_scheduler_mutex
+	uint64_t     generation; // pooled only: incremented when thread ends, guarded by `mutex`
+	mtx_t        mutex;     // guards timers and parking
+	cnd_t        is_not_empty;
+	thrd_t       thread;
+#ifdef AG_POOL_ALLOCATOR
+	ag_pool   pool;  // recycled along with ag_thread, so it takes back the blocks freed after its thread ended
+#endif
 } ag_thread;
 
 // Ag_threads never deallocated.
@@ -207,52 +417,46 @@ mtx_t       ag_threads_mutex;
 
 ag_thread ag_main_thread = { 0 };
 
-#define AG_RETAIN_BUFFER_SIZE 8192
 AG_THREAD_LOCAL ag_thread* ag_current_thread = NULL;
-AG_THREAD_LOCAL uintptr_t* ag_retain_buffer = NULL;
-AG_THREAD_LOCAL uintptr_t* ag_retain_pos;
-AG_THREAD_LOCAL uintptr_t* ag_release_pos;
-mtx_t ag_retain_release_mutex;
-
-void ag_flush_retain_release() {
-	mtx_lock(&ag_retain_release_mutex);
-	uintptr_t* i = ag_retain_buffer;
-	uintptr_t* term = ag_retain_pos;
-	for (; i != term; ++i) {
-		if (*i & 1)
-			((AgStringBuffer*)(*i & ~1))->counter_mt += 2;
-		else
-			((AgObject*)*i)->ctr_mt += AG_CTR_STEP;
-	}
-	i = ag_release_pos;
-	term = ag_retain_buffer + AG_RETAIN_BUFFER_SIZE;
-	AgObject* root = NULL;
-	for (; i != term; ++i) {
-		if (*i & 1) {
-			AgStringBuffer* str = (AgStringBuffer*)(*i & ~1);
-			if ((str->counter_mt -= 2) < 2)
-				ag_free(str);
 
-		} else {
-			AgObject* obj = (AgObject*)*i;
-			if ((obj->ctr_mt -= AG_CTR_STEP) < AG_CTR_STEP) {
-				obj->ctr_mt = (obj->ctr_mt & AG_CTR_WEAK) | ((intptr_t)root);
-				root = obj;
-			}
-		}
-	}
-	ag_retain_pos = ag_retain_buffer;
-	ag_release_pos = ag_retain_buffer + AG_RETAIN_BUFFER_SIZE;
-	mtx_unlock(&ag_retain_release_mutex);
-	while (root) {
-		AgObject* n = AG_UNTAG_PTR(AgObject, root->ctr_mt);
-		if (root->ctr_mt & AG_CTR_WEAK)
-			ag_free(root);
-		else
-			ag_dispose_obj(AG_UNTAG_PTR(AgObject, root));
-		root = n;
-	}
-}
+//
+// M:N mode, enabled by AG_WORKERS environment variable: ag_threads are multiplexed over a fixed pool of worker OS threads.
+// A thread gets scheduled (pushed to a worker's deque) when it receives a message or its timer gets due.
+// Its `scheduled` flag guarantees that it's never queued twice and never runs on two workers at once.
+// Both workers and thieves take threads in FIFO order, so a thread that keeps posting to its peer can't starve threads
+// queued before it, even with a single worker that has nobody to steal from it.
+//
+#define AG_SLICE_MESSAGES 64  // max messages handled before thread yields its worker
+
+typedef struct {
+	mtx_t       mutex;  // guards deque
+	ag_thread** deque;  // ring buffer
+	size_t      deque_alloc;  // power of two
+	size_t      top;    // owner and thieves take here
+	size_t      bottom; // threads are pushed here
+	thrd_t      thread;
+#ifdef AG_POOL_ALLOCATOR
+	ag_pool     pool;
+#endif
+} ag_worker;
+
+typedef struct {
+	uint64_t   at;  // ms, UTC
+	ag_thread* thread;
+} ag_wakeup;
+
+ag_worker*   ag_workers = NULL;
+int          ag_workers_count = 0;     // 0 if each ag_thread has its own OS thread
+volatile int ag_next_worker = 0;       // round robin for threads scheduled from non-worker threads
+volatile int ag_pending_threads = 0;   // scheduled but not yet taken by workers
+volatile int ag_idle_workers = 0;      // sleeping on ag_has_work
+mtx_t        ag_scheduler_mutex;       // guards wakeups and sleeping
+cnd_t        ag_has_work;
+ag_wakeup*   ag_wakeups = NULL;        // min-heap by `at`
+volatile size_t ag_wakeups_count = 0;
+size_t       ag_wakeups_alloc = 0;
+
+AG_THREAD_LOCAL ag_worker* ag_current_worker = NULL;
 
 inline void ag_set_parent_nn(AgObject* obj, AgObject* parent) {
 	if (obj->wb_p & AG_F_PARENT)
@@ -293,28 +497,30 @@ inline AgObject* ag_retain_pin(AgObject* obj) {
 	}
 	return obj;
 }
-inline void ag_reg_mt_release(uintptr_t p) {
-	if (--ag_release_pos == ag_retain_pos)
-		ag_flush_retain_release();
-	*ag_release_pos = p;
+// Objects and weak blocks shared between threads have AG_CTR_MT flag and atomic counters
+inline void ag_release_mt(AgObject* obj) {
+	if (ag_atomic_dec(&obj->ctr_mt, AG_CTR_STEP) < AG_CTR_STEP) {
+		if (obj->ctr_mt & AG_CTR_WEAK)  // it's AgWeak
+			ag_free(obj);
+		else
+			ag_dispose_obj(obj);
+	}
 }
-inline void ag_reg_mt_retain(uintptr_t p) {
-	*ag_retain_pos = p;
-	if (++ag_retain_pos == ag_release_pos)
-		ag_flush_retain_release();
+inline void ag_retain_mt(AgObject* obj) {
+	ag_atomic_inc(&obj->ctr_mt, AG_CTR_STEP);
 }
 void ag_release_weak(AgWeak* w) {
 	if (!ag_not_null(w))
 		return;
 	if (w->wb_ctr_mt & AG_CTR_MT) {
-		ag_reg_mt_release((uintptr_t)w);
+		ag_release_mt((AgObject*)w);
 	} else if ((w->wb_ctr_mt -= AG_CTR_STEP) == AG_CTR_WEAK) {
 		ag_free(w);
 	}
 }
 inline AgWeak* ag_retain_weak_nn(AgWeak* w) {
 	if (w->wb_ctr_mt & AG_CTR_MT) {
-		ag_reg_mt_retain((uintptr_t)w);
+		ag_retain_mt((AgObject*)w);
 	} else {
 		w->wb_ctr_mt += AG_CTR_STEP;
 	}
@@ -330,7 +536,7 @@ void ag_retain_weak(AgWeak* w) {
 void ag_release_own(AgObject* obj) {
 	if (ag_not_null(obj)) {
 		if (ag_head(obj)->ctr_mt & AG_CTR_MT)  // when in field it can point to a frozen shared mt.
-			ag_reg_mt_release((uintptr_t) obj);
+			ag_release_mt(obj);
 		else if ((ag_head(obj)->ctr_mt -= AG_CTR_STEP) < AG_CTR_STEP)
 			ag_dispose_obj(obj);
 		else
@@ -340,7 +546,7 @@ void ag_release_own(AgObject* obj) {
 void ag_retain_own(AgObject* obj, AgObject* parent) {
 	if (ag_not_null(obj)) {
 		if (ag_head(obj)->ctr_mt & AG_CTR_MT) {  // when in field it can point to a frozen shared mt
-			ag_reg_mt_retain((uintptr_t)obj);
+			ag_retain_mt(obj);
 		} else {
 			ag_head(obj)->ctr_mt += AG_CTR_STEP;
 			ag_set_parent_nn(obj, parent);
@@ -350,7 +556,7 @@ void ag_retain_own(AgObject* obj, AgObject* parent) {
 void ag_release_shared(AgObject* obj) {
 	if (ag_not_null(obj)) {
 		if (ag_head(obj)->ctr_mt & AG_CTR_MT)
-			ag_reg_mt_release((uintptr_t)obj);
+			ag_release_mt(obj);
 		else if ((ag_head(obj)->ctr_mt -= AG_CTR_STEP) == 0)
 			ag_dispose_obj(obj);
 	}
@@ -358,7 +564,7 @@ void ag_release_shared(AgObject* obj) {
 void ag_retain_shared(AgObject* obj) {
 	if (ag_not_null(obj)) {
 		if (ag_head(obj)->ctr_mt & AG_CTR_MT)
-			ag_reg_mt_retain((uintptr_t)obj);
+			ag_retain_mt(obj);
 		else
 			ag_head(obj)->ctr_mt += AG_CTR_STEP;
 	}
@@ -382,6 +588,38 @@ AG_THREAD_LOCAL size_t       ag_copy_fixers_alloc = 0;
 AG_THREAD_LOCAL AgCopyFixer* ag_copy_fixers = 0;        // Used only for objects with manual afterCopy operators.
 AG_THREAD_LOCAL bool         ag_copy_freeze = false;
 
+//
+// Copy worklist: ag_copy_object_field allocates the copy and defers copying its fields
+// to this FIFO ring, so deep hierarchies are copied breadth-first without recursion.
+//
+typedef struct {
+	AgObject* dst;
+	AgObject* src;
+} AgCopyTask;
+
+#define AG_COPY_PREFETCH_DISTANCE 8
+
+AG_THREAD_LOCAL AgCopyTask* ag_copy_tasks = 0;
+AG_THREAD_LOCAL size_t      ag_copy_tasks_head = 0;
+AG_THREAD_LOCAL size_t      ag_copy_tasks_count = 0;
+AG_THREAD_LOCAL size_t      ag_copy_tasks_alloc = 0;  // power of 2
+
+//
+// Objects whose weak blocks belong to other threads can't use the in-place tagging of `wb->target`,
+// so for them the copy operation keeps an open-addressing map: src weak block -> its copy.
+// Weak fields copied before their target object are chained through the dst fields in `pending`.
+//
+typedef struct {
+	AgWeak*   src;
+	AgObject* copy;     // 0 if not copied yet
+	void**    pending;  // chain of dst weak fields waiting for the copy
+} AgCopyXEntry;
+
+AG_THREAD_LOCAL AgCopyXEntry* ag_copy_xmap = 0;
+AG_THREAD_LOCAL size_t*       ag_copy_xmap_used = 0;  // indices of occupied entries, `ag_copy_xmap_count` of them
+AG_THREAD_LOCAL size_t        ag_copy_xmap_count = 0;
+AG_THREAD_LOCAL size_t        ag_copy_xmap_alloc = 0;  // power of 2, at least twice the count
+
 void ag_dispose_obj(AgObject* obj) {
 	((AgVmt*)(ag_head(obj)->dispatcher))[-1].dispose(obj);
 	AgWeak* wb = (AgWeak*)(ag_head(obj)->wb_p);
@@ -415,8 +653,200 @@ AgObject* ag_freeze(AgObject* src) {
 	ag_copy_freeze = false;
 	return r;
 }
+
+// In-place freeze is possible if nothing outside the hierarchy references its objects:
+// each object is referenced only by its owner (or the temp for root) and has no weak block.
+// Already shared subobjects can stay as is.
+// Both the check and the marking walk the hierarchy depth-first with `ag_freeze_stack` instead of recursion,
+// so `visit` hooks only enumerate fields and hierarchies of any depth don't overflow the native stack.
+typedef struct {
+	AgObject* owner;
+	bool      ok;
+} AgFreezeCheck;
+
+AG_THREAD_LOCAL AgObject** ag_freeze_stack = 0;
+AG_THREAD_LOCAL size_t     ag_freeze_stack_count = 0;
+AG_THREAD_LOCAL size_t     ag_freeze_stack_alloc = 0;
+
+static void* ag_grow_array(void* data, size_t item_size, size_t count, size_t* alloc);
+
+static void ag_push_freeze_stack(AgObject* obj) {
+	if (ag_freeze_stack_count == ag_freeze_stack_alloc)
+		ag_freeze_stack = ag_grow_array(ag_freeze_stack, sizeof(AgObject*), ag_freeze_stack_count, &ag_freeze_stack_alloc);
+	ag_freeze_stack[ag_freeze_stack_count++] = obj;
+}
+
+static void ag_check_freezable_field(void* field, int type, void* ctx) {
+	AgFreezeCheck* check = (AgFreezeCheck*) ctx;
+	if (type != AG_VISIT_OWN || !check->ok)
+		return;
+	AgObject* obj = *(AgObject**)field;
+	if (!ag_not_null(obj))
+		return;
+	uintptr_t wb_p = ag_head(obj)->wb_p;
+	if (wb_p == (AG_SHARED | AG_F_PARENT))
+		return;
+	if (wb_p != ((uintptr_t)check->owner | AG_F_PARENT) || ag_head(obj)->ctr_mt != AG_CTR_STEP)  // has weak block, other owner or extra refs
+		check->ok = false;
+	else
+		ag_push_freeze_stack(obj);
+}
+
+static bool ag_is_freezable_in_place(AgObject* root) {
+	AgFreezeCheck check = { (AgObject*) AG_IN_STACK, true };
+	ag_check_freezable_field(&root, AG_VISIT_OWN, &check);
+	while (check.ok && ag_freeze_stack_count) {
+		check.owner = ag_freeze_stack[--ag_freeze_stack_count];
+		((AgVmt*)(ag_head(check.owner)->dispatcher))[-1].visit(check.owner, ag_check_freezable_field, &check);
+	}
+	ag_freeze_stack_count = 0;
+	return check.ok;
+}
+
+static void ag_make_shared_field(void* field, int type, void* ctx) {
+	if (type == AG_VISIT_OWN) {
+		AgObject* obj = *(AgObject**)field;
+		if (ag_not_null(obj) && ag_head(obj)->wb_p != (AG_SHARED | AG_F_PARENT)) {
+			ag_head(obj)->wb_p = AG_SHARED | AG_F_PARENT;
+			ag_push_freeze_stack(obj);
+		}
+	}
+}
+
+static void ag_make_shared_in_place(AgObject* root) {
+	ag_make_shared_field(&root, AG_VISIT_OWN, 0);
+	while (ag_freeze_stack_count) {
+		AgObject* obj = ag_freeze_stack[--ag_freeze_stack_count];
+		((AgVmt*)(ag_head(obj)->dispatcher))[-1].visit(obj, ag_make_shared_field, 0);
+	}
+}
+
+AgObject* ag_freeze_temp(AgObject* src) {
+	if (ag_is_freezable_in_place(src)) {
+		ag_make_shared_in_place(src);
+		return src;
+	}
+	AgObject* r = ag_freeze(src);
+	ag_release_pin(src);
+	return r;
+}
+
+static inline size_t ag_copy_xmap_slot(AgWeak* wb, size_t mask) {
+	uint64_t h = (uint64_t)(uintptr_t)wb * 0x9e3779b97f4a7c15;
+	return (size_t)(h ^ (h >> 32)) & mask;
+}
+
+static AgCopyXEntry* ag_copy_xmap_get(AgWeak* wb) {
+	if (ag_copy_xmap_count * 2 >= ag_copy_xmap_alloc) {
+		AgCopyXEntry* old = ag_copy_xmap;
+		size_t* old_used = ag_copy_xmap_used;
+		ag_copy_xmap_alloc = ag_copy_xmap_alloc ? ag_copy_xmap_alloc * 2 : 64;
+		ag_copy_xmap = (AgCopyXEntry*) AG_ALLOC(sizeof(AgCopyXEntry) * ag_copy_xmap_alloc);
+		ag_copy_xmap_used = (size_t*) AG_ALLOC(sizeof(size_t) * ag_copy_xmap_alloc / 2);
+		if (!ag_copy_xmap || !ag_copy_xmap_used)
+			exit(-42);
+		ag_zero_mem(ag_copy_xmap, sizeof(AgCopyXEntry) * ag_copy_xmap_alloc);
+		for (size_t i = 0; i < ag_copy_xmap_count; i++) {
+			AgCopyXEntry* e = old + old_used[i];
+			size_t j = ag_copy_xmap_slot(e->src, ag_copy_xmap_alloc - 1);
+			while (ag_copy_xmap[j].src)
+				j = (j + 1) & (ag_copy_xmap_alloc - 1);
+			ag_copy_xmap[j] = *e;
+			ag_copy_xmap_used[i] = j;
+		}
+		if (old) {
+			AG_FREE(old);
+			AG_FREE(old_used);
+		}
+	}
+	size_t mask = ag_copy_xmap_alloc - 1;
+	for (size_t i = ag_copy_xmap_slot(wb, mask);; i = (i + 1) & mask) {
+		AgCopyXEntry* e = ag_copy_xmap + i;
+		if (e->src == wb)
+			return e;
+		if (!e->src) {
+			e->src = wb;
+			ag_copy_xmap_used[ag_copy_xmap_count++] = i;
+			return e;
+		}
+	}
+}
+
+// Returns the weak block of a copy made for a foreign-thread object, creating it if needed.
+static AgWeak* ag_copy_xmap_weak(AgObject* copy) {
+	if ((ag_head(copy)->wb_p & AG_F_PARENT) == 0)
+		return (AgWeak*) ag_head(copy)->wb_p;
+	AgWeak* wb = (AgWeak*) ag_alloc(sizeof(AgWeak));
+	if (!wb) { exit(-42); }
+	wb->org_pointer_to_parent = ag_head(copy)->wb_p & ~AG_F_PARENT;
+	wb->target = copy;
+	wb->wb_ctr_mt = AG_CTR_STEP | AG_CTR_WEAK;  // locked by the object
+	wb->thread = ag_current_thread;  // copy belongs to this thread
+	ag_head(copy)->wb_p = (uintptr_t) wb;
+	return wb;
+}
+
+// Weak fields to foreign objects that were not copied keep pointing to the originals.
+static void ag_copy_xmap_finalize() {
+	for (size_t i = 0; i < ag_copy_xmap_count; i++) {
+		AgCopyXEntry* e = ag_copy_xmap + ag_copy_xmap_used[i];
+		for (void** w = e->pending; w;) {
+			void** next = (void**) *w;
+			*w = ag_retain_weak_nn(e->src);
+			w = next;
+		}
+		e->src = 0;
+		e->copy = 0;
+		e->pending = 0;
+	}
+	ag_copy_xmap_count = 0;
+	if (ag_copy_xmap_alloc > 4096) {  // don't keep tables left by huge copies
+		AG_FREE(ag_copy_xmap);
+		AG_FREE(ag_copy_xmap_used);
+		ag_copy_xmap = 0;
+		ag_copy_xmap_used = 0;
+		ag_copy_xmap_alloc = 0;
+	}
+}
+
+static void ag_copy_push_task(AgObject* dst, AgObject* src) {
+	if (ag_copy_tasks_count == ag_copy_tasks_alloc) {
+		size_t old_alloc = ag_copy_tasks_alloc;
+		AgCopyTask* old = ag_copy_tasks;
+		ag_copy_tasks_alloc = old_alloc ? old_alloc * 2 : 256;
+		ag_copy_tasks = (AgCopyTask*) AG_ALLOC(sizeof(AgCopyTask) * ag_copy_tasks_alloc);
+		if (!ag_copy_tasks)
+			exit(-42);
+		for (size_t i = 0; i < ag_copy_tasks_count; i++)
+			ag_copy_tasks[i] = old[(ag_copy_tasks_head + i) & (old_alloc - 1)];
+		ag_copy_tasks_head = 0;
+		if (old)
+			AG_FREE(old);
+	}
+	AgCopyTask* t = ag_copy_tasks + ((ag_copy_tasks_head + ag_copy_tasks_count++) & (ag_copy_tasks_alloc - 1));
+	t->dst = dst;
+	t->src = src;
+}
+
+static void ag_copy_run_tasks() {
+	while (ag_copy_tasks_count) {
+		size_t mask = ag_copy_tasks_alloc - 1;
+		if (ag_copy_tasks_count > AG_COPY_PREFETCH_DISTANCE) {
+			AgCopyTask* ahead = ag_copy_tasks + ((ag_copy_tasks_head + AG_COPY_PREFETCH_DISTANCE) & mask);
+			ag_prefetch(ahead->src);
+			ag_prefetch(ahead->dst);
+		}
+		AgCopyTask t = ag_copy_tasks[ag_copy_tasks_head];  // copy_ref_fields may grow the ring
+		ag_copy_tasks_head = (ag_copy_tasks_head + 1) & mask;
+		ag_copy_tasks_count--;
+		((AgVmt*)(ag_head(t.src)->dispatcher))[-1].copy_ref_fields(t.dst, t.src);
+	}
+	ag_copy_tasks_head = 0;
+}
+
 AgObject* ag_copy(AgObject* src) {
 	AgObject* dst = ag_copy_object_field(src, 0);
+	ag_copy_run_tasks();
 	for (AgObject* obj = ag_copy_head; obj;) {
 		if (AG_PTR_TAG(obj) == AG_TG_NOWEAK_DST) {
 			AgObject* dst = AG_UNTAG_PTR(AgObject, obj);
@@ -425,7 +855,12 @@ AgObject* ag_copy(AgObject* src) {
 		} else {
 			assert(AG_PTR_TAG(obj) == AG_TG_OBJECT);
 			obj = AG_UNTAG_PTR(AgObject, obj);
-			assert(AG_PTR_TAG(obj->wb_p) == AG_TG_WEAK_BLOCK);
+			if (obj->wb_p & AG_F_PARENT) {  // copy made before any weak to it, and no weak copied after
+				AgObject* next = (AgObject*) obj->ctr_mt;
+				obj->ctr_mt = AG_CTR_STEP;
+				obj = next;
+				continue;
+			}
 			AgWeak* wb = (AgWeak*) obj->wb_p;
 			void* next = wb->target;
 			wb->target = obj;
@@ -439,6 +874,8 @@ AgObject* ag_copy(AgObject* src) {
 		}
 	}
 	ag_copy_head = 0;
+	if (ag_copy_xmap_count)
+		ag_copy_xmap_finalize();
 	while (ag_copy_fixers_count) {  // TODO retain objects in the copy_fixers vector.
 		AgCopyFixer* f = ag_copy_fixers + --ag_copy_fixers_count;
 		f->fixer(f->data);
@@ -457,13 +894,22 @@ AgObject* ag_copy_object_field(AgObject* src, AgObject* parent) {
 	ag_memcpy(dh, ag_head(src), vmt->instance_alloc_size + AG_HEAD_SIZE);
 	dh->ctr_mt = AG_CTR_STEP;
 	dh->wb_p = (uintptr_t) AG_TAG_PTR(AgObject, parent, AG_F_PARENT);  //NO_WEAK also makes it AG_TG_NOWEAK_DST
-	vmt->copy_ref_fields((AgObject*)(dh + AG_HEAD_SIZE), src);
+	ag_copy_push_task((AgObject*)(dh + AG_HEAD_SIZE), src);
 	if ((ag_head(src)->wb_p & AG_F_PARENT) == 0) { // has weak block
 		AgWeak* wb = (AgWeak*) ag_head(src)->wb_p;
 		if (wb->thread != ag_current_thread) {
-			// TODO: implement hashmap lookup or tree splicing array lookup
-			// So far cross-thread weak pointers to shared objects do not maintain topology.
-			// I'm not sure if this should be a bug.
+			AgCopyXEntry* e = ag_copy_xmap_get(wb);
+			e->copy = (AgObject*)(dh + AG_HEAD_SIZE);
+			if (e->pending) {
+				AgWeak* dst_wb = ag_copy_xmap_weak(e->copy);
+				for (void** w = e->pending; w;) {
+					void** next = (void**) *w;
+					*w = dst_wb;
+					dst_wb->wb_ctr_mt += AG_CTR_STEP;
+					w = next;
+				}
+				e->pending = 0;
+			}
 		} else {
 			if (wb->target == src) { // no weak copied yet
 				dh->ctr_mt = (uintptr_t)ag_copy_head;  // AG_TG_NOWEAK_DST uses counter as link
@@ -502,7 +948,17 @@ void ag_fn_sys_make_shared(AgObject* obj) {  // TODO: implement hierarchy freeze
 void ag_copy_weak_field(void** dst, AgWeak* src) {
 	if (!src || (size_t)src < 256) {
 		*dst = src;
-	} else if (!src->target || src->thread != ag_current_thread) {
+	} else if (src->thread != ag_current_thread) {
+		AgCopyXEntry* e = ag_copy_xmap_get(src);
+		if (e->copy) {
+			AgWeak* cwb = ag_copy_xmap_weak(e->copy);
+			cwb->wb_ctr_mt += AG_CTR_STEP;
+			*dst = cwb;
+		} else {
+			*dst = e->pending;
+			e->pending = dst;
+		}
+	} else if (!src->target) {
 		ag_retain_weak_nn(src);
 		*dst = src;
 	} else {
@@ -524,7 +980,8 @@ void ag_copy_weak_field(void** dst, AgWeak* src) {
 				cwb->thread = src->thread;
 				cwb->org_pointer_to_parent = ag_head(copy)->wb_p & ~AG_F_PARENT;
 				cwb->wb_ctr_mt = AG_CTR_STEP | AG_CTR_WEAK;
-				cwb->target = (AgObject*)(ag_head(copy)->ctr_mt);
+				cwb->target = (AgObject*)(ag_head(copy)->ctr_mt);  // queue link moves to the weak block
+				ag_head(copy)->ctr_mt = AG_CTR_STEP;
 				ag_head(copy)->wb_p = (uintptr_t) cwb;
 			} else
 				cwb = AG_UNTAG_PTR(AgWeak, ag_head(copy)->wb_p);
@@ -586,7 +1043,7 @@ void ag_copy_sys_String(AgString* d, AgString* s) {
 	d->buffer = s->buffer;
 	if (d->buffer) {
 		if (d->buffer->counter_mt & 1)
-			ag_reg_mt_retain((uintptr_t)d->buffer | 1);
+			ag_atomic_inc(&d->buffer->counter_mt, 2);
 		else
 			d->buffer->counter_mt += 2;
 	}
@@ -603,39 +1060,111 @@ void ag_visit_sys_String(
 
 void ag_dtor_sys_String(AgString* s) {
 	if (s->buffer) {
-		if (s->buffer->counter_mt & 1)
-			ag_reg_mt_release((uintptr_t)s->buffer | 1);
-		else if ((s->buffer->counter_mt -= 2) < 2)
+		if (s->buffer->counter_mt & 1 ? ag_atomic_dec(&s->buffer->counter_mt, 2) < 2 : (s->buffer->counter_mt -= 2) < 2)
 			ag_free(s->buffer);
 	}
 }
 
 int64_t ag_m_sys_Container_capacity(AgBlob* b) {
-	return b->size;
+	return b->size;  // number of items, `allocated` is an implementation detail
 }
 
-void ag_m_sys_Container_insertItems(AgBlob* b, uint64_t index, uint64_t count) {
-	if (!count || index > b->size)
+#define AG_CONTAINER_MIN_ALLOC 4
+
+//
+// Blob buffer sharing, enabled by AG_SHARED_BLOB_BUFFERS:
+// Container item buffers are prefixed with a counter of containers using them.
+// Blob copies share the buffer of their source, which is left intact (it may be frozen and used by other threads).
+// The first mutating method called on a blob whose buffer counter is not 1 makes its own buffer.
+// Otherwise buffers have no counter and blobs are copied eagerly.
+//
+#ifdef AG_SHARED_BLOB_BUFFERS
+
+static int64_t* ag_alloc_items(uint64_t count) {
+	uintptr_t* r = (uintptr_t*) ag_alloc(sizeof(int64_t) * (count + 1));
+	if (!r)
+		exit(-42);
+	*r = 1;
+	return (int64_t*)(r + 1);
+}
+
+static void ag_release_items(int64_t* data) {
+	if (data && ag_atomic_dec((uintptr_t*)data - 1, 1) == 0)
+		ag_free((uintptr_t*)data - 1);
+}
+
+static inline bool ag_is_blob_shared(AgBlob* b) {
+	return b->data && ag_atomic_load_ptr((void**)b->data - 1) != (void*)1;
+}
+
+#else
+
+static int64_t* ag_alloc_items(uint64_t count) {
+	int64_t* r = (int64_t*) ag_alloc(sizeof(int64_t) * count);
+	if (!r)
+		exit(-42);
+	return r;
+}
+
+static void ag_release_items(int64_t* data) {
+	ag_free(data);
+}
+
+static inline bool ag_is_blob_shared(AgBlob* b) {
+	return false;
+}
+
+#endif
+
+// Called by mutating Blob methods before writing
+static inline void ag_unshare_blob(AgBlob* b) {
+	if (!ag_is_blob_shared(b))
 		return;
-	int64_t* new_data = (int64_t*) ag_alloc(sizeof(int64_t) * (b->size + count));
+	int64_t* data = ag_alloc_items(b->size);
+	ag_memcpy(data, b->data, sizeof(int64_t) * b->size);
+	ag_release_items(b->data);
+	b->data = data;
+	b->allocated = b->size;
+}
+
+// Moves items to a new buffer of `new_alloc` items, leaving a gap of `gap` items at `index`
+static void ag_realloc_container(AgBlob* b, uint64_t new_alloc, uint64_t index, uint64_t gap) {
+	int64_t* new_data = ag_alloc_items(new_alloc);
 	ag_memcpy(new_data, b->data, sizeof(int64_t) * index);
-	ag_zero_mem(new_data + index, sizeof(int64_t) * count);
-	ag_memcpy(new_data + index + count, b->data + index, sizeof(int64_t) * (b->size - index));
-	ag_free(b->data);
+	ag_memcpy(new_data + index + gap, b->data + index, sizeof(int64_t) * (b->size - index));
+	ag_release_items(b->data);
 	b->data = new_data;
-	b->size += count;
+	b->allocated = new_alloc;
+}
+
+void ag_m_sys_Container_insertItems(AgBlob* b, uint64_t index, uint64_t count) {
+	if (!count || index > b->size)
+		return;
+	uint64_t new_size = b->size + count;
+	if (new_size > b->allocated || ag_is_blob_shared(b)) {  // realloc also makes own buffer for shared blobs
+		uint64_t new_alloc = b->allocated * 2;
+		ag_realloc_container(b, new_alloc < new_size ? new_size : new_alloc, index, count);
+	} else {
+		ag_memmove(b->data + index + count, b->data + index, sizeof(int64_t) * (b->size - index));
+	}
+	ag_zero_mem(b->data + index, sizeof(int64_t) * count);
+	b->size = new_size;
 }
 
 void ag_m_sys_Blob_deleteBytes(AgBlob* b, uint64_t index, uint64_t bytes_count) {
-	if (!bytes_count || index > b->size * sizeof(int64_t) || index + bytes_count > b->size * sizeof(int64_t))
+	uint64_t byte_size = b->size * sizeof(int64_t);
+	if (!bytes_count || index > byte_size || index + bytes_count > byte_size)
 		return;
-	size_t new_byte_size = (b->size * sizeof(int64_t) - bytes_count + 7) & ~7;
-	int64_t* new_data = (int64_t*) ag_alloc(new_byte_size);
-	ag_memcpy(new_data, b->data, index);
-	ag_memcpy((char*)new_data + index, (char*)b->data + index + bytes_count, (b->size * sizeof(int64_t) - index));
-	ag_free(b->data);
-	b->data = new_data;
-	b->size -= new_byte_size >> 3;
+	ag_unshare_blob(b);
+	uint64_t new_byte_size = byte_size - bytes_count;
+	uint64_t new_size = (new_byte_size + sizeof(int64_t) - 1) / sizeof(int64_t);
+	ag_memmove((char*)b->data + index, (char*)b->data + index + bytes_count, new_byte_size - index);
+	ag_zero_mem((char*)b->data + new_byte_size, new_size * sizeof(int64_t) - new_byte_size);
+	b->size = new_size;
+	if (new_size < b->allocated / 4 && b->allocated > AG_CONTAINER_MIN_ALLOC) {
+		uint64_t new_alloc = new_size * 2;
+		ag_realloc_container(b, new_alloc < AG_CONTAINER_MIN_ALLOC ? AG_CONTAINER_MIN_ALLOC : new_alloc, new_size, 0);
+	}
 }
 
 void ag_m_sys_Array_delete(AgBlob* b, uint64_t index, uint64_t count) {
@@ -662,6 +1191,7 @@ void ag_m_sys_WeakArray_delete(AgBlob* b, uint64_t index, uint64_t count) {
 bool ag_m_sys_Container_moveItems(AgBlob* blob, uint64_t a, uint64_t b, uint64_t c) {
 	if (a >= b || b >= c || c > blob->size)
 		return false;
+	ag_unshare_blob(blob);
 	uint64_t* temp = (uint64_t*) ag_alloc(sizeof(uint64_t) * (b - a));
 	ag_memmove(temp, blob->data + a, sizeof(uint64_t) * (b - a));
 	ag_memmove(blob->data + a, blob->data + b, sizeof(uint64_t) * (c - b));
@@ -676,30 +1206,36 @@ int64_t ag_m_sys_Blob_get8At(AgBlob* b, uint64_t index) {
 }
 
 void ag_m_sys_Blob_set8At(AgBlob* b, uint64_t index, int64_t val) {
-	if (index / sizeof(int64_t) < b->size)
+	if (index / sizeof(int64_t) < b->size) {
+		ag_unshare_blob(b);
 		((uint8_t*)(b->data))[index] = (uint8_t)val;
+	}
 }
 
 int64_t ag_m_sys_Blob_get16At(AgBlob* b, uint64_t index) {
-	return index / sizeof(int64_t) * sizeof(int16_t) < b->size
+	return index / (sizeof(int64_t) / sizeof(int16_t)) < b->size
 		? ((uint16_t*)(b->data))[index]
 		: 0;
 }
 
 void ag_m_sys_Blob_set16At(AgBlob* b, uint64_t index, int64_t val) {
-	if (index / sizeof(int64_t) * sizeof(int16_t) < b->size)
+	if (index / (sizeof(int64_t) / sizeof(int16_t)) < b->size) {
+		ag_unshare_blob(b);
 		((uint16_t*)(b->data))[index] = (uint16_t)val;
+	}
 }
 
 int64_t ag_m_sys_Blob_get32At(AgBlob* b, uint64_t index) {
-	return index / sizeof(int64_t) * sizeof(int32_t) < b->size
+	return index / (sizeof(int64_t) / sizeof(int32_t)) < b->size
 		? ((uint32_t*)(b->data))[index]
 		: 0;
 }
 
 void ag_m_sys_Blob_set32At(AgBlob* b, uint64_t index, int64_t val) {
-	if (index / sizeof(int64_t) * sizeof(int32_t) < b->size)
+	if (index / (sizeof(int64_t) / sizeof(int32_t)) < b->size) {
+		ag_unshare_blob(b);
 		((uint32_t*)(b->data))[index] = (uint32_t)val;
+	}
 }
 
 int64_t ag_m_sys_Blob_get64At(AgBlob* b, uint64_t index) {
@@ -707,13 +1243,16 @@ int64_t ag_m_sys_Blob_get64At(AgBlob* b, uint64_t index) {
 }
 
 void ag_m_sys_Blob_set64At(AgBlob* b, uint64_t index, int64_t val) {
-	if (index < b->size)
+	if (index < b->size) {
+		ag_unshare_blob(b);
 		b->data[index] = val;
+	}
 }
 
 bool ag_m_sys_Blob_copyBytesTo(AgBlob* dst, uint64_t dst_index, AgBlob* src, uint64_t src_index, uint64_t bytes) {
 	if ((src_index + bytes) / sizeof(int64_t) >= src->size || (dst_index + bytes) / sizeof(int64_t) >= dst->size)
 		return false;
+	ag_unshare_blob(dst);
 	ag_memmove(((uint8_t*)(dst->data)) + dst_index, ((uint8_t*)(src->data)) + src_index, bytes);
 	return true;
 }
@@ -776,9 +1315,15 @@ void ag_m_sys_WeakArray_setAt(AgBlob* b, uint64_t index, AgWeak* val) {
 }
 
 void ag_copy_sys_Blob(AgBlob* d, AgBlob* s) {
-	d->size = s->size;
-	d->data = (int64_t*) ag_alloc(sizeof(int64_t) * d->size);
+	d->size = d->allocated = s->size;
+#ifdef AG_SHARED_BLOB_BUFFERS
+	d->data = s->data;
+	if (s->data)
+		ag_atomic_inc((uintptr_t*)s->data - 1, 1);
+#else
+	d->data = ag_alloc_items(d->size);
 	ag_memcpy(d->data, s->data, sizeof(int64_t) * d->size);
+#endif
 }
 
 void ag_visit_sys_Blob(
@@ -798,8 +1343,8 @@ void ag_visit_sys_Container(
 {}
 
 void ag_copy_sys_Array(AgBlob* d, AgBlob* s) {
-	d->size = s->size;
-	d->data = (int64_t*) ag_alloc(sizeof(int64_t) * d->size);
+	d->size = d->allocated = s->size;
+	d->data = ag_alloc_items(d->size);
 	for (AgObject
 			**from = (AgObject**) (s->data),
 			**to =   (AgObject**) (d->data),
@@ -830,8 +1375,8 @@ void ag_visit_sys_Array(
 }
 
 void ag_copy_sys_WeakArray(AgBlob* d, AgBlob* s) {
-	d->size = s->size;
-	d->data = (int64_t*) ag_alloc(sizeof(int64_t) * d->size);
+	d->size = d->allocated = s->size;
+	d->data = ag_alloc_items(d->size);
 	void** to = (void**)(d->data);
 	for (AgWeak
 			**from = (AgWeak**)(s->data),
@@ -860,7 +1405,7 @@ void ag_visit_sys_WeakArray(
 }
 
 void ag_dtor_sys_Blob(AgBlob* p) {
-	ag_free(p->data);
+	ag_release_items(p->data);
 }
 void ag_dtor_sys_Container(AgBlob* p) {
 	ag_dtor_sys_Blob(p);
@@ -875,7 +1420,7 @@ void ag_dtor_sys_Array(AgBlob* p) {
 	{
 		ag_release_own(*ptr);
 	}
-	ag_free(p->data);
+	ag_release_items(p->data);
 }
 
 void ag_dtor_sys_WeakArray(AgBlob* p) {
@@ -887,15 +1432,338 @@ void ag_dtor_sys_WeakArray(AgBlob* p) {
 	{
 		ag_release_weak(*ptr);
 	}
-	ag_free(p->data);
+	ag_release_items(p->data);
+}
+
+//
+// AgMap support: Swiss table style open addressing.
+// Each slot has a control byte: AG_MAP_EMPTY, AG_MAP_DELETED or 7 low bits of key hash.
+// Control bytes are scanned by aligned groups of AG_MAP_GROUP slots with one SIMD compare.
+// String keys are hashed and compared by content, all other keys - by identity.
+//
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define AG_MAP_SSE2
+#endif
+
+#define AG_MAP_EMPTY   ((int8_t)-128)
+#define AG_MAP_DELETED ((int8_t)-2)
+#define AG_MAP_GROUP   16
+
+typedef struct {
+	AgObject* key;   // shared
+	void*     val;   // AgObject* for Map, AgWeak* for WeakMap
+	uint64_t  hash;
+} ag_map_entry;
+
+static inline ag_map_entry* ag_map_entries(AgMap* m) {
+	return (ag_map_entry*)(m->ctrl + m->capacity);
+}
+
+// Returns bit mask of group slots having control byte `c`
+static inline uint32_t ag_map_match(int8_t* group, int8_t c) {
+#ifdef AG_MAP_SSE2
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)group), _mm_set1_epi8(c)));
+#else
+	uint32_t r = 0;
+	for (int i = 0; i < AG_MAP_GROUP; i++)
+		r |= (uint32_t)(group[i] == c) << i;
+	return r;
+#endif
+}
+
+// Returns bit mask of empty or deleted group slots
+static inline uint32_t ag_map_match_free(int8_t* group) {
+#ifdef AG_MAP_SSE2
+	return _mm_movemask_epi8(_mm_loadu_si128((__m128i*)group));
+#else
+	uint32_t r = 0;
+	for (int i = 0; i < AG_MAP_GROUP; i++)
+		r |= (uint32_t)(group[i] < 0) << i;
+	return r;
+#endif
+}
+
+static inline bool ag_is_string(AgObject* obj) {
+	return ((AgVmt*)(obj->dispatcher))[-1].dispose == (void(*)(void*))ag_dtor_sys_String;
+}
+
+static uint64_t ag_map_hash(AgObject* key) {
+	uint64_t h = (uint64_t)(uintptr_t)key;
+	if (ag_is_string(key)) {
+		h = 0xcbf29ce484222325;  // FNV-1a
+		for (const char* c = ((AgString*)key)->ptr; c && *c; c++)
+			h = (h ^ (uint8_t)*c) * 0x100000001b3;
+	}
+	h ^= h >> 33;  // murmur3 finalizer, spreads bits to h2 and h1 parts
+	h *= 0xff51afd7ed558ccd;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53;
+	return h ^ (h >> 33);
+}
+
+static bool ag_map_keys_equal(AgObject* a, AgObject* b) {
+	if (a == b)
+		return true;
+	if (!ag_is_string(a) || !ag_is_string(b))
+		return false;
+	const char* sa = ((AgString*)a)->ptr;
+	const char* sb = ((AgString*)b)->ptr;
+	if (!sa || !sb)
+		return sa == sb;
+	for (; *sa == *sb; sa++, sb++) {
+		if (!*sa)
+			return true;
+	}
+	return false;
+}
+
+// Returns slot index or -1. Probing visits all groups, and stops at a group having an empty slot.
+static int64_t ag_map_find(AgMap* m, AgObject* key, uint64_t hash) {
+	if (!m->capacity)
+		return -1;
+	uint64_t mask = m->capacity - 1;
+	ag_map_entry* entries = ag_map_entries(m);
+	uint64_t pos = (hash >> 7) & mask & ~(uint64_t)(AG_MAP_GROUP - 1);
+	for (uint64_t step = AG_MAP_GROUP;; step += AG_MAP_GROUP) {
+		for (uint32_t bits = ag_map_match(m->ctrl + pos, hash & 0x7f); bits; bits &= bits - 1) {
+			uint64_t i = pos + ag_ctz(bits);
+			if (entries[i].hash == hash && ag_map_keys_equal(entries[i].key, key))
+				return (int64_t)i;
+		}
+		if (ag_map_match(m->ctrl + pos, AG_MAP_EMPTY))
+			return -1;
+		pos = (pos + step) & mask;
+	}
+}
+
+static uint64_t ag_map_find_free(AgMap* m, uint64_t hash) {
+	uint64_t mask = m->capacity - 1;
+	uint64_t pos = (hash >> 7) & mask & ~(uint64_t)(AG_MAP_GROUP - 1);
+	for (uint64_t step = AG_MAP_GROUP;; step += AG_MAP_GROUP) {
+		uint32_t bits = ag_map_match_free(m->ctrl + pos);
+		if (bits)
+			return pos + ag_ctz(bits);
+		pos = (pos + step) & mask;
+	}
+}
+
+// Rehashes all entries to a new table, dropping deleted slots
+static void ag_map_resize(AgMap* m, uint64_t new_capacity) {
+	int8_t* old_ctrl = m->ctrl;
+	ag_map_entry* old_entries = ag_map_entries(m);
+	uint64_t old_capacity = m->capacity;
+	m->ctrl = (int8_t*) ag_alloc(new_capacity * (1 + sizeof(ag_map_entry)));
+	if (!m->ctrl)
+		exit(-42);
+	for (uint64_t i = 0; i < new_capacity; i++)
+		m->ctrl[i] = AG_MAP_EMPTY;
+	m->capacity = new_capacity;
+	m->growth_left = new_capacity - new_capacity / 8 - m->count;
+	ag_map_entry* entries = ag_map_entries(m);
+	for (uint64_t i = 0; i < old_capacity; i++) {
+		if (old_ctrl[i] >= 0) {
+			uint64_t slot = ag_map_find_free(m, old_entries[i].hash);
+			m->ctrl[slot] = old_ctrl[i];
+			entries[slot] = old_entries[i];
+		}
+	}
+	ag_free(old_ctrl);
+}
+
+// Returns existing entry or a new one with retained key and null value
+static ag_map_entry* ag_map_insert(AgMap* m, AgObject* key) {
+	uint64_t hash = ag_map_hash(key);
+	int64_t found = ag_map_find(m, key, hash);
+	if (found >= 0)
+		return ag_map_entries(m) + found;
+	if (!m->growth_left) {  // grow, or just drop deleted slots if they took the most of space
+		ag_map_resize(m,
+			!m->capacity ? AG_MAP_GROUP :
+			m->count >= m->capacity * 7 / 16 ? m->capacity * 2 :
+			m->capacity);
+	}
+	uint64_t slot = ag_map_find_free(m, hash);
+	if (m->ctrl[slot] == AG_MAP_EMPTY)
+		m->growth_left--;
+	m->ctrl[slot] = hash & 0x7f;
+	m->count++;
+	ag_map_entry* r = ag_map_entries(m) + slot;
+	ag_retain_shared(key);
+	r->key = key;
+	r->val = NULL;
+	r->hash = hash;
+	return r;
+}
+
+// Returns false if key is not found, otherwise passes the ownership of removed value to caller
+static bool ag_map_remove(AgMap* m, AgObject* key, void** val) {
+	int64_t i = ag_map_find(m, key, ag_map_hash(key));
+	if (i < 0)
+		return false;
+	// If slot's group has an empty slot, no probe sequence went past this group, so slot can become empty.
+	if (ag_map_match(m->ctrl + (i & ~(int64_t)(AG_MAP_GROUP - 1)), AG_MAP_EMPTY)) {
+		m->ctrl[i] = AG_MAP_EMPTY;
+		m->growth_left++;
+	} else {
+		m->ctrl[i] = AG_MAP_DELETED;
+	}
+	m->count--;
+	ag_map_entry* e = ag_map_entries(m) + i;
+	ag_release_shared(e->key);
+	*val = e->val;
+	return true;
+}
+
+static void ag_map_copy_table(AgMap* d, AgMap* s) {
+	d->count = s->count;
+	d->capacity = s->capacity;
+	d->growth_left = s->growth_left;
+	d->ctrl = NULL;
+	if (s->capacity) {
+		d->ctrl = (int8_t*) ag_alloc(s->capacity * (1 + sizeof(ag_map_entry)));
+		if (!d->ctrl)
+			exit(-42);
+		ag_memcpy(d->ctrl, s->ctrl, s->capacity * (1 + sizeof(ag_map_entry)));
+	}
+}
+
+AgObject* ag_m_sys_Map_getAt(AgMap* m, AgObject* key) {
+	int64_t i = ag_map_find(m, key, ag_map_hash(key));
+	return i < 0
+		? 0
+		: ag_retain_pin((AgObject*)ag_map_entries(m)[i].val);
+}
+
+void ag_m_sys_Map_setAt(AgMap* m, AgObject* key, AgObject* val) {
+	ag_map_entry* e = ag_map_insert(m, key);
+	ag_retain_own(val, &m->head);
+	ag_release_own((AgObject*)e->val);
+	e->val = val;
+}
+
+bool ag_m_sys_Map_delete(AgMap* m, AgObject* key) {
+	void* val;
+	if (!ag_map_remove(m, key, &val))
+		return false;
+	ag_release_own((AgObject*)val);
+	return true;
+}
+
+int64_t ag_m_sys_Map_size(AgMap* m) {
+	return m->count;
+}
+
+AgWeak* ag_m_sys_WeakMap_getAt(AgMap* m, AgObject* key) {
+	int64_t i = ag_map_find(m, key, ag_map_hash(key));
+	if (i < 0)
+		return 0;
+	AgWeak* r = (AgWeak*)ag_map_entries(m)[i].val;
+	ag_retain_weak(r);
+	return r;
+}
+
+void ag_m_sys_WeakMap_setAt(AgMap* m, AgObject* key, AgWeak* val) {
+	ag_map_entry* e = ag_map_insert(m, key);
+	ag_retain_weak(val);
+	ag_release_weak((AgWeak*)e->val);
+	e->val = val;
+}
+
+bool ag_m_sys_WeakMap_delete(AgMap* m, AgObject* key) {
+	void* val;
+	if (!ag_map_remove(m, key, &val))
+		return false;
+	ag_release_weak((AgWeak*)val);
+	return true;
+}
+
+int64_t ag_m_sys_WeakMap_size(AgMap* m) {
+	return m->count;
+}
+
+void ag_copy_sys_Map(AgMap* d, AgMap* s) {
+	ag_map_copy_table(d, s);
+	ag_map_entry* from = ag_map_entries(s);
+	ag_map_entry* to = ag_map_entries(d);
+	for (uint64_t i = 0; i < d->capacity; i++) {
+		if (d->ctrl[i] >= 0) {
+			ag_retain_shared(to[i].key);
+			to[i].val = ag_copy_object_field((AgObject*)from[i].val, &d->head);
+		}
+	}
+}
+
+void ag_copy_sys_WeakMap(AgMap* d, AgMap* s) {
+	ag_map_copy_table(d, s);
+	ag_map_entry* from = ag_map_entries(s);
+	ag_map_entry* to = ag_map_entries(d);
+	for (uint64_t i = 0; i < d->capacity; i++) {
+		if (d->ctrl[i] >= 0) {
+			ag_retain_shared(to[i].key);
+			ag_copy_weak_field(&to[i].val, (AgWeak*)from[i].val);
+		}
+	}
+}
+
+void ag_visit_sys_Map(
+	AgMap* m,
+	void(*visitor)(void*, int, void*),
+	void* ctx)
+{
+	if (ag_not_null(m)) {
+		ag_map_entry* e = ag_map_entries(m);
+		for (uint64_t i = 0; i < m->capacity; i++) {
+			if (m->ctrl[i] >= 0) {
+				visitor(&e[i].key, AG_VISIT_OWN, ctx);
+				visitor(&e[i].val, AG_VISIT_OWN, ctx);
+			}
+		}
+	}
+}
+
+void ag_visit_sys_WeakMap(
+	AgMap* m,
+	void(*visitor)(void*, int, void*),
+	void* ctx)
+{
+	if (ag_not_null(m)) {
+		ag_map_entry* e = ag_map_entries(m);
+		for (uint64_t i = 0; i < m->capacity; i++) {
+			if (m->ctrl[i] >= 0) {
+				visitor(&e[i].key, AG_VISIT_OWN, ctx);
+				visitor(&e[i].val, AG_VISIT_WEAK, ctx);
+			}
+		}
+	}
+}
+
+void ag_dtor_sys_Map(AgMap* m) {
+	ag_map_entry* e = ag_map_entries(m);
+	for (uint64_t i = 0; i < m->capacity; i++) {
+		if (m->ctrl[i] >= 0) {
+			ag_release_shared(e[i].key);
+			ag_release_own((AgObject*)e[i].val);
+		}
+	}
+	ag_free(m->ctrl);
+}
+
+void ag_dtor_sys_WeakMap(AgMap* m) {
+	ag_map_entry* e = ag_map_entries(m);
+	for (uint64_t i = 0; i < m->capacity; i++) {
+		if (m->ctrl[i] >= 0) {
+			ag_release_shared(e[i].key);
+			ag_release_weak((AgWeak*)e[i].val);
+		}
+	}
+	ag_free(m->ctrl);
 }
 
 void ag_release_str(AgString* s) {
 	if (!s->buffer)
 		return;
-	if (s->buffer->counter_mt & 1)
-		ag_reg_mt_release((uintptr_t)s);
-	else if ((s->buffer->counter_mt -= 2) < 2)
+	if (s->buffer->counter_mt & 1 ? ag_atomic_dec(&s->buffer->counter_mt, 2) < 2 : (s->buffer->counter_mt -= 2) < 2)
 		ag_free(s->buffer);
 }
 
@@ -919,9 +1787,10 @@ static int ag_put_fn(void* ctx, int b) {
 }
 
 int64_t ag_m_sys_Blob_putChAt(AgBlob* b, int at, int codepoint) {
-	char* cursor = ((char*)(b->data)) + at;
 	if (at + 5 > b->size * sizeof(uint64_t))
 		return 0;
+	ag_unshare_blob(b);
+	char* cursor = ((char*)(b->data)) + at;
 	put_utf8(codepoint, &cursor, ag_put_fn);
 	return cursor - (char*)(b->data);
 }
@@ -947,27 +1816,82 @@ void ag_make_blob_fit(AgBlob* b, size_t required_size) {
 	required_size = (required_size + sizeof(int64_t) - 1) / sizeof(int64_t);
 	if (b->size < required_size)
 		ag_m_sys_Container_insertItems(b, b->size, required_size - b->size);
+	ag_unshare_blob(b);  // callers write to `data` directly
 }
 
 static void ag_init_queue(ag_queue* q) {
-	q->read_pos = q->write_pos = q->start = AG_ALLOC(sizeof(int64_t) * AG_THREAD_QUEUE_SIZE);
-	q->end = q->start + AG_THREAD_QUEUE_SIZE;
+	q->stub.next = NULL;
+	q->head = q->tail = &q->stub;
+}
+
+static void ag_push_message(ag_queue* q, ag_message* msg) {
+	msg->next = NULL;
+	ag_message* prev = ag_atomic_exchange_ptr(&q->tail, msg);
+	ag_atomic_store_ptr(&prev->next, msg);
+}
+
+// Returns NULL if queue is empty or if a producer has not finished its push yet
+static ag_message* ag_pop_message(ag_queue* q) {
+	ag_message* head = q->head;
+	ag_message* next = ag_atomic_load_ptr(&head->next);
+	if (head == &q->stub) {
+		if (!next)
+			return NULL;
+		q->head = head = next;
+		next = ag_atomic_load_ptr(&next->next);
+	}
+	if (next) {
+		q->head = next;
+		return head;
+	}
+	if (head != ag_atomic_load_ptr(&q->tail))
+		return NULL;
+	ag_push_message(q, &q->stub);
+	next = ag_atomic_load_ptr(&head->next);
+	if (next) {
+		q->head = next;
+		return head;
+	}
+	return NULL;
+}
+
+static bool ag_queue_is_empty(ag_queue* q) {
+	return q->head == &q->stub && !ag_atomic_load_ptr(&q->stub.next);
 }
 
 static void ag_init_thread(ag_thread* th) {
 	ag_init_queue(&th->in);
-	ag_init_queue(&th->out);
 	mtx_init(&th->mutex, mtx_plain);
 	cnd_init(&th->is_not_empty);
+	th->reading = NULL;
+	th->parked = th->closed = th->posters = 0;
 	th->root = NULL;
-	th->timer_ms = 0;
-	th->timer_proc = 0;
-	th->timer_proc_param = 0;
+	th->timers = NULL;
+	th->timers_count = th->timers_alloc = 0;
+	th->timer_slots = NULL;
+	th->timer_slots_count = th->timer_slots_alloc = 0;
+	th->free_timer_slot = 0;
+	th->scheduled = 0;
+	th->pooled = th->recycled = false;
+	th->wakeup_at = th->generation = 0;
+}
+
+static void ag_schedule(ag_thread* th);
+
+// Wakes thread up only if it's parked, so a burst of messages costs one wakeup
+static void ag_wake_thread(ag_thread* th) {
+	if (th->pooled) {
+		ag_schedule(th);
+	} else if (ag_atomic_exchange_int(&th->parked, 0)) {
+		mtx_lock(&th->mutex);
+		cnd_signal(&th->is_not_empty);
+		mtx_unlock(&th->mutex);
+	}
 }
 
 bool ag_fn_sys_setMainObject(AgObject* s) {
 	ag_thread* th = &ag_main_thread;
-	if (!th->in.start)
+	if (!th->in.tail)
 		ag_init_thread(th);
 	ag_release_own(th->root);
 	if (s && ag_fn_sys_getParent(s)) {
@@ -978,114 +1902,182 @@ bool ag_fn_sys_setMainObject(AgObject* s) {
 	return true;
 }
 
-void ag_resize_queue(ag_queue* q, size_t space_needed) {
-	size_t free_space = q->read_pos > q->write_pos
-		? q->write_pos - q->read_pos
-		: (q->end - q->start) - (q->write_pos - q->read_pos);
-	if (free_space < space_needed) {
-		uint64_t new_size = (q->end - q->start) * 2 + space_needed;
-		uint64_t* new_buf = AG_ALLOC(sizeof(uint64_t) * new_size);
-		if (!new_buf)
-			exit(-42);
-		if (q->read_pos > q->write_pos) {
-			size_t r_size = q->end - q->read_pos;
-			size_t w_size = q->write_pos - q->start;
-			memcpy(new_buf + new_size - r_size, q->read_pos, sizeof(uint64_t) * (r_size));
-			memcpy(new_buf, q->start, sizeof(uint64_t) * (w_size));
-			AG_FREE(q->start);
-			q->read_pos = new_buf + new_size - r_size;
-			q->write_pos = new_buf + w_size;
-		} else {
-			size_t size = q->write_pos - q->read_pos;
-			memcpy(new_buf, q->read_pos, sizeof(uint64_t) * size);
-			AG_FREE(q->start);
-			q->read_pos = new_buf;
-			q->write_pos = new_buf + size;
-		}
-		q->start = new_buf;
-		q->end = new_buf + new_size;
-	}
+uint64_t ag_get_thread_param(ag_thread* th) {  // for trampolines
+	return *th->read_pos++;
 }
 
-uint64_t ag_read_queue(ag_queue* q) {
-	uint64_t r = *q->read_pos;
-	if (++q->read_pos == q->end)
-		q->read_pos = q->start;
+void ag_unlock_thread_queue(ag_thread* th) { // for trampolines
+	ag_free(th->reading);
+	th->reading = NULL;
+}
+
+static void* ag_grow_array(void* data, size_t item_size, size_t count, size_t* alloc) {
+	size_t new_alloc = *alloc ? *alloc * 2 : 16;
+	void* r = AG_ALLOC(item_size * new_alloc);
+	if (!r)
+		exit(-42);
+	if (data) {
+		ag_memcpy(r, data, item_size * count);
+		AG_FREE(data);
+	}
+	*alloc = new_alloc;
 	return r;
 }
 
-void ag_write_queue(ag_queue* q, uint64_t param) {
-	*q->write_pos = param;
-	if (++q->write_pos == q->end)
-		q->write_pos = q->start;
+static inline void ag_put_timer(ag_thread* th, size_t pos, ag_timer* timer) {
+	th->timers[pos] = *timer;
+	th->timer_slots[timer->slot].pos = pos;
 }
 
-uint64_t ag_get_thread_param(ag_thread* th) {  // for trampolines
-	return ag_read_queue(&th->in);
+static void ag_timer_sift_up(ag_thread* th, size_t pos) {
+	ag_timer t = th->timers[pos];
+	while (pos) {
+		size_t parent = (pos - 1) / 2;
+		if (th->timers[parent].at <= t.at)
+			break;
+		ag_put_timer(th, pos, th->timers + parent);
+		pos = parent;
+	}
+	ag_put_timer(th, pos, &t);
 }
 
-void ag_unlock_thread_queue(ag_thread* th) { // for trampolines
+static void ag_timer_sift_down(ag_thread* th, size_t pos) {
+	ag_timer t = th->timers[pos];
+	for (;;) {
+		size_t child = pos * 2 + 1;
+		if (child >= th->timers_count)
+			break;
+		if (child + 1 < th->timers_count && th->timers[child + 1].at < th->timers[child].at)
+			child++;
+		if (t.at <= th->timers[child].at)
+			break;
+		ag_put_timer(th, pos, th->timers + child);
+		pos = child;
+	}
+	ag_put_timer(th, pos, &t);
+}
+
+// Removes timer from heap and frees its slot, caller takes the ownership of timer's receiver
+static ag_timer ag_remove_timer(ag_thread* th, size_t pos) {
+	ag_timer r = th->timers[pos];
+	th->timer_slots[r.slot].id = 0;
+	th->timer_slots[r.slot].pos = th->free_timer_slot;
+	th->free_timer_slot = r.slot + 1;
+	if (pos != --th->timers_count) {
+		ag_put_timer(th, pos, th->timers + th->timers_count);
+		ag_timer_sift_down(th, pos);
+		ag_timer_sift_up(th, pos);
+	}
+	return r;
+}
+
+static void ag_clear_timers(ag_thread* th) {
+	mtx_lock(&th->mutex);
+	while (th->timers_count) {
+		ag_timer t = ag_remove_timer(th, th->timers_count - 1);
+		ag_release_weak(t.receiver);
+	}
 	mtx_unlock(&th->mutex);
 }
 
-static ag_thread* ag_lock_thread(AgWeak* receiver) {
+uint64_t ag_timer_sequence = 0;
+
+// Returns timer id or 0 if receiver's thread is dead
+int64_t ag_fn_sys_postTimer(int64_t at, AgWeak* receiver, ag_fn fn) {
 	ag_thread* th = (ag_thread*)receiver->thread;
 	if (!th)
-		return NULL;
+		return 0;
 	mtx_lock(&th->mutex);
-	if (receiver->thread != th) { // thread had died or object moved while we were locking it
+	if (th->closed) {  // ending thread sets it before clearing timers under this mutex
 		mtx_unlock(&th->mutex);
-		return NULL;
+		return 0;
 	}
-	return th;
-}
-
-void ag_unlock_and_notify_thread(ag_thread* th) {
+	size_t slot;
+	if (th->free_timer_slot) {
+		slot = th->free_timer_slot - 1;
+		th->free_timer_slot = th->timer_slots[slot].pos;
+	} else {
+		if (th->timer_slots_count == (size_t)1 << AG_TIMER_SLOT_BITS) {
+			mtx_unlock(&th->mutex);
+			return 0;
+		}
+		if (th->timer_slots_count == th->timer_slots_alloc)
+			th->timer_slots = ag_grow_array(th->timer_slots, sizeof(ag_timer_slot), th->timer_slots_count, &th->timer_slots_alloc);
+		slot = th->timer_slots_count++;
+	}
+	if (th->timers_count == th->timers_alloc)
+		th->timers = ag_grow_array(th->timers, sizeof(ag_timer), th->timers_count, &th->timers_alloc);
+	ag_retain_weak(receiver);
+	ag_timer t = { at, fn, receiver, slot };
+	uint64_t id = ag_atomic_inc(&ag_timer_sequence, 1) << AG_TIMER_SLOT_BITS | slot;
+	th->timer_slots[slot].id = id;
+	th->timers[th->timers_count] = t;
+	ag_timer_sift_up(th, th->timers_count++);
+	bool is_first = th->timers[0].slot == slot;
 	mtx_unlock(&th->mutex);
-	cnd_broadcast(&th->is_not_empty);
+	if (is_first) {  // otherwise thread already waits for an earlier deadline
+		if (th->pooled)
+			ag_schedule(th);  // to register new wakeup
+		else
+			cnd_signal(&th->is_not_empty);
+	}
+	return (int64_t)id;
 }
 
-bool ag_fn_sys_postTimer(int64_t at, AgWeak* receiver, ag_fn fn) {
-	ag_thread* th = ag_lock_thread(receiver);
-	if (!th)
+// Cancels timer posted to an object of current thread, returns false if timer already fired or canceled
+bool ag_fn_sys_cancelTimer(int64_t id) {
+	ag_thread* th = ag_current_thread;
+	size_t slot = (uint64_t)id & (((size_t)1 << AG_TIMER_SLOT_BITS) - 1);
+	if (!th || id <= 0)
 		return false;
-	th->timer_ms = at;
-	th->timer_proc = fn;
-	th->timer_proc_param = receiver;
-	ag_unlock_and_notify_thread(th);
+	mtx_lock(&th->mutex);
+	if (slot >= th->timer_slots_count || th->timer_slots[slot].id != (uint64_t)id) {
+		mtx_unlock(&th->mutex);
+		return false;
+	}
+	ag_timer t = ag_remove_timer(th, th->timer_slots[slot].pos);
+	mtx_unlock(&th->mutex);
+	ag_release_weak(t.receiver);
 	return true;
 }
 
-// returns mtx-locked thread or NULL if receiver's thread is dead
-// receiver goes prelocked
+// Message being composed on this thread
+AG_THREAD_LOCAL ag_message* ag_posted_message = NULL;
+AG_THREAD_LOCAL uint64_t*   ag_post_pos;
+
+// Returns receiver's thread or NULL if receiver's thread is dead
+// Returned thread is kept in `posters` until ag_finalize_post_message, so it can't end with this message left in its queue.
 ag_thread* ag_prepare_post_message(AgWeak* receiver, ag_fn fn, ag_trampoline tramp, size_t params_count) {
-	ag_thread* th = ag_lock_thread(receiver);
-	if (!th)
+	ag_thread* th = (ag_thread*)receiver->thread;
+	if (!th || ag_atomic_load_int(&th->closed))  // checked before touching `posters` to not starve ag_close_thread
 		return NULL;
-	if (!ag_current_thread) {
-		mtx_unlock(&th->mutex);
-		return NULL; // todo add support for non-ag threads
-	}
-	// no need to lock out-queue thread b/c it's our thread
-	ag_queue* q = &ag_current_thread->out;
-	ag_resize_queue(
-		q,
-		params_count + 4);  // params_count + params + trampoline + entry_point + receiver_weak
-	ag_put_thread_param(th, (uint64_t) tramp);
-	ag_put_thread_param(th, (uint64_t) receiver); // if weak posted to another thread, it's already mt-marked, no need to mark it here
-	ag_put_thread_param(th, (uint64_t) fn);
-	ag_put_thread_param(th, (uint64_t) params_count);
+	ag_atomic_add_int(&th->posters, 1);
+	if (ag_atomic_load_int(&th->closed)) {
+		ag_atomic_add_int(&th->posters, -1);
+		return NULL;
+	}
+	ag_posted_message = (ag_message*)ag_alloc(sizeof(ag_message) + sizeof(uint64_t) * params_count);
+	if (!ag_posted_message)
+		exit(-42);
+	ag_posted_message->params[0] = (uint64_t)tramp;
+	ag_posted_message->params[1] = (uint64_t)receiver; // if weak posted to another thread, it's already mt-marked, no need to mark it here
+	ag_posted_message->params[2] = (uint64_t)fn;
+	ag_post_pos = ag_posted_message->params + 3;
 	return th;
 }
 
 void ag_put_thread_param(ag_thread* th, uint64_t param) {
 	if (th)
-		ag_write_queue(&ag_current_thread->out, param);
+		*ag_post_pos++ = param;
 }
 
 void ag_finalize_post_message(ag_thread* th) {
-	if (th)
-		mtx_unlock(&th->mutex);
+	if (th) {
+		ag_push_message(&th->in, ag_posted_message);
+		ag_posted_message = NULL;
+		ag_wake_thread(th);
+		ag_atomic_add_int(&th->posters, -1);
+	}
 }
 
 inline void ag_make_weak_mt(AgWeak* w) {
@@ -1144,98 +2136,320 @@ void ag_put_thread_param_own_ptr(ag_thread* th, AgObject* param) {
 	ag_put_thread_param(th, (uint64_t)param);
 }
 
-void ag_init_retain_buffer() {
-	if (ag_retain_buffer)
-		return;
-	ag_retain_buffer = AG_ALLOC(sizeof(intptr_t) * AG_RETAIN_BUFFER_SIZE);
-	ag_retain_pos = ag_retain_buffer;
-	ag_release_pos = ag_retain_buffer + AG_RETAIN_BUFFER_SIZE;
+static void ag_handle_message(ag_thread* th, ag_message* msg) {
+	uint64_t tramp = msg->params[0];
+	if (!tramp) {
+		ag_free(msg);
+		AgObject* r = th->root;
+		th->root = NULL;
+		ag_release_own(r);
+		ag_clear_timers(th);
+	} else {
+		AgWeak* w_receiver = (AgWeak*)msg->params[1];
+		ag_fn entry_point = (ag_fn)msg->params[2];
+		th->reading = msg;
+		th->read_pos = msg->params + 3;
+		AgObject* receiver = ag_deref_weak(w_receiver);
+		((ag_trampoline)tramp)(receiver, entry_point, th); // it frees message internally
+		ag_release_pin(receiver);
+		ag_release_weak(w_receiver);
+	}
 }
 
-void ag_maybe_flush_retain_release() {
-	if (ag_retain_buffer != ag_retain_pos || ag_release_pos != ag_retain_buffer + AG_RETAIN_BUFFER_SIZE)
-		ag_flush_retain_release();
+// Releases message params without calling its receiver
+static void ag_dispose_message(ag_thread* th, ag_message* msg) {
+	uint64_t tramp = msg->params[0];
+	if (!tramp) {
+		ag_free(msg);
+		return;
+	}
+	AgWeak* w_receiver = (AgWeak*)msg->params[1];
+	th->reading = msg;
+	th->read_pos = msg->params + 3;
+	((ag_trampoline)tramp)(NULL, (ag_fn)msg->params[2], th); // it frees message internally
+	ag_release_weak(w_receiver);
+}
+
+// Called by the ended thread. Refuses further posts, waits for posters that passed the `closed` check,
+// and disposes the messages they left, so no message outlives the thread and none is handled by the next user of `th`.
+static void ag_close_thread(ag_thread* th) {
+	ag_atomic_exchange_int(&th->closed, 1);
+	while (ag_atomic_load_int(&th->posters))
+		thrd_yield();
+	for (ag_message* msg; (msg = ag_pop_message(&th->in));)
+		ag_dispose_message(th, msg);
+	ag_clear_timers(th);
+}
+
+// Returns false if there is no due timer
+static bool ag_fire_due_timer(ag_thread* th) {
+	struct timespec now;
+	mtx_lock(&th->mutex);
+	if (!th->timers_count || !timespec_get(&now, TIME_UTC) || timespec_to_ms(&now) < th->timers[0].at) {
+		mtx_unlock(&th->mutex);
+		return false;
+	}
+	ag_timer t = ag_remove_timer(th, 0);
+	mtx_unlock(&th->mutex);
+	AgObject* timer_object = ag_deref_weak(t.receiver);
+	if (timer_object) {
+		t.proc(timer_object);
+		ag_release_pin(timer_object);
+	}
+	ag_release_weak(t.receiver);
+	return true;
 }
 
 int ag_thread_proc(ag_thread* th) {
 	ag_current_thread = th;
-	ag_init_retain_buffer();
-	struct timespec now;
-	mtx_lock(&th->mutex);
-	for (;;) {
-		if (th->in.read_pos != th->in.write_pos) {
-			uint64_t tramp = ag_get_thread_param(th);
-			if (!tramp) {
-				mtx_unlock(&th->mutex);
-				AgObject* r = th->root;
-				th->root = NULL;
-				ag_release_own(r);
-				if (th->timer_ms) {
-					ag_release_weak(th->timer_proc_param);
-					th->timer_ms = 0;
-				}
-			} else {
-				AgWeak* w_receiver = (AgWeak*)ag_get_thread_param(th);
-				ag_fn entry_point = (ag_fn)ag_get_thread_param(th);
-				AgObject* receiver = ag_deref_weak(w_receiver);
-				((ag_trampoline)tramp)(receiver, entry_point, th); // it unlocks mutex internally
-				ag_release_pin(receiver);
-				ag_release_weak(w_receiver);
-			}
-			mtx_lock(&th->mutex);
-		} else if (th->timer_ms && timespec_get(&now, TIME_UTC) && timespec_to_ms(&now) <= th->timer_ms) {
-			th->timer_ms = 0;
-			AgObject* timer_object = ag_deref_weak(th->timer_proc_param);
-			if (timer_object) {
-				mtx_unlock(&th->mutex);
-				th->timer_proc(timer_object);
-				ag_release_pin(timer_object);
-				mtx_lock(&th->mutex);
-			}
-		} else if (th->out.read_pos != th->out.write_pos) {
-			ag_maybe_flush_retain_release();
-			mtx_unlock(&th->mutex);
-			ag_queue* out = &th->out;
-			while (out->read_pos != out->write_pos) {
-				uint64_t tramp = ag_read_queue(out);
-				uint64_t recv = ag_read_queue(out);
-				uint64_t fn = ag_read_queue(out);
-				uint64_t count = ag_read_queue(out);
-				ag_thread* out_th = ag_lock_thread((AgWeak*)recv);
-				if (!out_th) {
-					out_th = th; // send to myself to dispose
-					mtx_lock(&th->mutex);
-				}
-				ag_queue* q = &out_th->in;
-				ag_resize_queue(
-					q,
-					count + 3);  // trampoline + entry_point + receiver_weak + params
-				ag_write_queue(q, (uint64_t)tramp);
-				ag_write_queue(q, recv);
-				ag_write_queue(q, fn);
-				for (; count; --count)
-					ag_write_queue(q, ag_read_queue(out));
-				ag_unlock_and_notify_thread(out_th);
-			}
-			mtx_lock(&th->mutex);
-		} else if (th->root) {
-			if (th->timer_ms) {
+#ifdef AG_POOL_ALLOCATOR
+	ag_current_pool = &th->pool;
+#endif
+	while (th->root) {  // once it's gone, ag_close_thread disposes the rest of messages
+		ag_message* msg = ag_pop_message(&th->in);
+		if (msg) {
+			ag_handle_message(th, msg);
+			continue;
+		}
+		if (ag_fire_due_timer(th))
+			continue;
+		mtx_lock(&th->mutex);
+		// Posters check `parked` after pushing, we check queue after setting `parked`, so no wakeup is lost.
+		ag_atomic_exchange_int(&th->parked, 1);
+		if (ag_queue_is_empty(&th->in)) {
+			if (th->timers_count) {
 				struct timespec timeout;
-				timeout.tv_sec = th->timer_ms / 1000;
-				timeout.tv_nsec = th->timer_ms % 1000 * 1000000;
+				timeout.tv_sec = th->timers[0].at / 1000;
+				timeout.tv_nsec = th->timers[0].at % 1000 * 1000000;
 				cnd_timedwait(&th->is_not_empty, &th->mutex, &timeout);
 			} else {
 				cnd_wait(&th->is_not_empty, &th->mutex);
 			}
-		} else {
+		}
+		ag_atomic_exchange_int(&th->parked, 0);
+		mtx_unlock(&th->mutex);
+	}
+	ag_close_thread(th);
+	return 0;
+}
+
+static void ag_push_to_worker(ag_worker* w, ag_thread* th) {
+	mtx_lock(&w->mutex);
+	if (w->bottom - w->top == w->deque_alloc) {
+		size_t new_alloc = w->deque_alloc ? w->deque_alloc * 2 : 64;
+		ag_thread** d = (ag_thread**)AG_ALLOC(sizeof(ag_thread*) * new_alloc);
+		if (!d)
+			exit(-42);
+		for (size_t i = w->top; i != w->bottom; i++)
+			d[i & (new_alloc - 1)] = w->deque[i & (w->deque_alloc - 1)];
+		if (w->deque)
+			AG_FREE(w->deque);
+		w->deque = d;
+		w->deque_alloc = new_alloc;
+	}
+	w->deque[w->bottom++ & (w->deque_alloc - 1)] = th;
+	mtx_unlock(&w->mutex);
+}
+
+static ag_thread* ag_take_from_worker(ag_worker* w) {
+	ag_thread* r = NULL;
+	mtx_lock(&w->mutex);
+	if (w->bottom != w->top)
+		r = w->deque[w->top++ & (w->deque_alloc - 1)];
+	mtx_unlock(&w->mutex);
+	return r;
+}
+
+// Caller must own th->scheduled flag.
+// Threads that yielded their worker go to the bottom as well, so they run after all threads that were already waiting.
+static void ag_submit(ag_thread* th) {
+	ag_worker* w = ag_current_worker
+		? ag_current_worker
+		: ag_workers + (unsigned)ag_atomic_add_int(&ag_next_worker, 1) % ag_workers_count;
+	ag_push_to_worker(w, th);
+	// Idle workers increment ag_idle_workers before checking ag_pending_threads, so no wakeup is lost.
+	ag_atomic_add_int(&ag_pending_threads, 1);
+}
+
+static void ag_notify_worker() {
+	if (ag_atomic_load_int(&ag_idle_workers)) {
+		mtx_lock(&ag_scheduler_mutex);
+		cnd_signal(&ag_has_work);
+		mtx_unlock(&ag_scheduler_mutex);
+	}
+}
+
+static void ag_schedule(ag_thread* th) {
+	if (!ag_atomic_exchange_int(&th->scheduled, 1)) {
+		ag_submit(th);
+		ag_notify_worker();
+	}
+}
+
+static void ag_push_wakeup(uint64_t at, ag_thread* th) {
+	if (ag_wakeups_count == ag_wakeups_alloc)
+		ag_wakeups = ag_grow_array(ag_wakeups, sizeof(ag_wakeup), ag_wakeups_count, &ag_wakeups_alloc);
+	size_t pos = ag_wakeups_count++;
+	while (pos) {
+		size_t parent = (pos - 1) / 2;
+		if (ag_wakeups[parent].at <= at)
 			break;
+		ag_wakeups[pos] = ag_wakeups[parent];
+		pos = parent;
+	}
+	ag_wakeups[pos].at = at;
+	ag_wakeups[pos].thread = th;
+}
+
+static ag_wakeup ag_pop_wakeup() {
+	ag_wakeup r = ag_wakeups[0];
+	ag_wakeup last = ag_wakeups[--ag_wakeups_count];
+	size_t pos = 0;
+	for (;;) {
+		size_t child = pos * 2 + 1;
+		if (child >= ag_wakeups_count)
+			break;
+		if (child + 1 < ag_wakeups_count && ag_wakeups[child + 1].at < ag_wakeups[child].at)
+			child++;
+		if (last.at <= ag_wakeups[child].at)
+			break;
+		ag_wakeups[pos] = ag_wakeups[child];
+		pos = child;
+	}
+	if (ag_wakeups_count)
+		ag_wakeups[pos] = last;
+	return r;
+}
+
+// Called under ag_scheduler_mutex, returns the next wakeup time or 0 if none
+static uint64_t ag_schedule_due_wakeups() {
+	struct timespec now;
+	uint64_t now_ms = timespec_get(&now, TIME_UTC) ? timespec_to_ms(&now) : 0;
+	int scheduled = 0;
+	while (ag_wakeups_count && ag_wakeups[0].at <= now_ms) {
+		ag_wakeup w = ag_pop_wakeup();
+		if (w.thread->wakeup_at != w.at)  // superseded by an earlier wakeup
+			continue;
+		w.thread->wakeup_at = 0;
+		if (!ag_atomic_exchange_int(&w.thread->scheduled, 1)) {
+			ag_submit(w.thread);
+			scheduled++;
 		}
 	}
+	if (scheduled > 1 && ag_idle_workers)
+		cnd_broadcast(&ag_has_work);
+	return ag_wakeups_count ? ag_wakeups[0].at : 0;
+}
+
+static void ag_register_wakeup(ag_thread* th) {
+	mtx_lock(&th->mutex);
+	uint64_t at = th->timers_count ? th->timers[0].at : 0;
+	mtx_unlock(&th->mutex);
+	if (!at)
+		return;
+	mtx_lock(&ag_scheduler_mutex);
+	if (!th->wakeup_at || at < th->wakeup_at) {
+		th->wakeup_at = at;
+		ag_push_wakeup(at, th);
+		if (ag_wakeups[0].thread == th)  // sleeping workers need a shorter timeout
+			cnd_signal(&ag_has_work);
+	}
+	mtx_unlock(&ag_scheduler_mutex);
+}
+
+static void ag_recycle_pooled_thread(ag_thread* th) {
+	ag_close_thread(th);
+	mtx_lock(&th->mutex);
+	th->generation++;
+	cnd_broadcast(&th->is_not_empty);  // for ag_dtor_sys_Thread waiting on non-worker thread
 	mtx_unlock(&th->mutex);
-	ag_maybe_flush_retain_release();
+	mtx_lock(&ag_threads_mutex);
+	th->recycled = true;
+	th->next_free = ag_thread_free;
+	ag_thread_free = th;
+	mtx_unlock(&ag_threads_mutex);
+}
+
+static void ag_run_thread_slice(ag_thread* th) {
+	ag_current_thread = th;
+	int budget = AG_SLICE_MESSAGES;
+	for (ag_message* msg; budget && (msg = ag_pop_message(&th->in)); budget--)
+		ag_handle_message(th, msg);
+	while (budget && ag_fire_due_timer(th))
+		budget--;
+	ag_current_thread = NULL;
+	if (th->root)
+		ag_register_wakeup(th);
+	else if (!th->recycled)
+		ag_recycle_pooled_thread(th);
+	if (!ag_queue_is_empty(&th->in)) {  // keep `scheduled` and let other threads run
+		ag_submit(th);
+		ag_notify_worker();
+		return;
+	}
+	// Posters set `scheduled` after pushing, we check queue after clearing it, so no message is left unhandled.
+	ag_atomic_exchange_int(&th->scheduled, 0);
+	if (!ag_queue_is_empty(&th->in))
+		ag_schedule(th);
+}
+
+int ag_worker_proc(void* p) {
+	ag_worker* w = (ag_worker*)p;
+	ag_current_worker = w;
+#ifdef AG_POOL_ALLOCATOR
+	ag_current_pool = &w->pool;
+#endif
+	for (;;) {
+		if (ag_wakeups_count) {
+			mtx_lock(&ag_scheduler_mutex);
+			ag_schedule_due_wakeups();
+			mtx_unlock(&ag_scheduler_mutex);
+		}
+		ag_thread* th = ag_take_from_worker(w);
+		for (int i = 1; !th && i < ag_workers_count; i++)
+			th = ag_take_from_worker(ag_workers + (w - ag_workers + i) % ag_workers_count);
+		if (th) {
+			ag_atomic_add_int(&ag_pending_threads, -1);
+			ag_run_thread_slice(th);
+			continue;
+		}
+		mtx_lock(&ag_scheduler_mutex);
+		ag_atomic_add_int(&ag_idle_workers, 1);
+		uint64_t wakeup_at = ag_schedule_due_wakeups();
+		if (ag_atomic_load_int(&ag_pending_threads) <= 0) {
+			if (wakeup_at) {
+				struct timespec timeout;
+				timeout.tv_sec = wakeup_at / 1000;
+				timeout.tv_nsec = wakeup_at % 1000 * 1000000;
+				cnd_timedwait(&ag_has_work, &ag_scheduler_mutex, &timeout);
+			} else {
+				cnd_wait(&ag_has_work, &ag_scheduler_mutex);
+			}
+		}
+		ag_atomic_add_int(&ag_idle_workers, -1);
+		mtx_unlock(&ag_scheduler_mutex);
+	}
 	return 0;
 }
 
+static void ag_start_workers() {
+	const char* env = getenv("AG_WORKERS");
+	int count = env ? atoi(env) : 0;
+	if (count <= 0)
+		return;
+	mtx_init(&ag_scheduler_mutex, mtx_plain);
+	cnd_init(&ag_has_work);
+	ag_workers = (ag_worker*)AG_ALLOC(sizeof(ag_worker) * count);
+	if (!ag_workers)
+		exit(-42);
+	ag_zero_mem(ag_workers, sizeof(ag_worker) * count);
+	for (int i = 0; i < count; i++)
+		mtx_init(&ag_workers[i].mutex, mtx_plain);
+	ag_workers_count = count;
+	for (int i = 0; i < ag_workers_count; i++)
+		thrd_create(&ag_workers[i].thread, ag_worker_proc, ag_workers + i);
+}
+
 int ag_handle_main_thread() {
 	if (ag_main_thread.root) {
 		ag_thread_proc(&ag_main_thread);
@@ -1246,14 +2460,14 @@ int ag_handle_main_thread() {
 AgThread* ag_m_sys_Thread_start(AgThread* th, AgObject* root) {
 	ag_thread* t = NULL;
 	if (!ag_alloc_thread) { // it's first thread creation
-		ag_init_retain_buffer();
-		mtx_init(&ag_retain_release_mutex, mtx_plain);
 		mtx_init(&ag_threads_mutex, mtx_plain);
+		ag_start_workers();
 	}
 	mtx_lock(&ag_threads_mutex);
-	if (ag_thread_free) {
+	// Pooled thread can still handle stale messages after it ended, so it's reused only if we can own its `scheduled` flag.
+	if (ag_thread_free && (!ag_workers_count || !ag_atomic_exchange_int(&ag_thread_free->scheduled, 1))) {
 		t = ag_thread_free;
-		ag_thread_free = (ag_thread*)ag_thread_free->timer_proc_param;
+		ag_thread_free = ag_thread_free->next_free;
 	} else {
 		if (!ag_alloc_threads_left) {
 			ag_alloc_threads_left = 16;
@@ -1264,6 +2478,10 @@ AgThread* ag_m_sys_Thread_start(AgThread* th, AgObject* root) {
 		t = ag_alloc_thread++;
 		ag_alloc_threads_left--;
 		ag_init_thread(t);
+		t->scheduled = 1;
+#ifdef AG_POOL_ALLOCATOR
+		ag_zero_mem(&t->pool, sizeof(ag_pool));
+#endif
 	}
 	mtx_unlock(&ag_threads_mutex);
 	// TODO: make root object marker value for parent ptr.
@@ -1273,7 +2491,16 @@ AgThread* ag_m_sys_Thread_start(AgThread* th, AgObject* root) {
 	w->wb_ctr_mt = (w->wb_ctr_mt - AG_CTR_STEP) | AG_CTR_MT;
 	w->thread = t;
 	th->head.ctr_mt += AG_CTR_STEP;
-	thrd_create(&t->thread, ag_thread_proc, t);
+	ag_atomic_exchange_int(&t->closed, 0);  // recycled thread accepts posts again
+	if (ag_workers_count) {
+		t->pooled = true;
+		t->recycled = false;
+		ag_atomic_exchange_int(&t->scheduled, 0);
+		if (!ag_queue_is_empty(&t->in))
+			ag_schedule(t);
+	} else {
+		thrd_create(&t->thread, ag_thread_proc, t);
+	}
 	return th;
 }
 
@@ -1287,13 +2514,28 @@ void ag_dtor_sys_Thread(AgThread* ptr) {
 	if (ptr->thread) {
 		ag_thread* th = ptr->thread;
 		mtx_lock(&th->mutex);
-		ag_resize_queue(&th->in, 1);
-		ag_write_queue(&th->in, 0);
-		ag_unlock_and_notify_thread(th);
-		int unused_result;
-		thrd_join(th->thread, &unused_result);
-		th->timer_proc_param = (AgWeak*) ag_thread_free;
-		ag_thread_free = th;
+		uint64_t generation = th->generation;
+		mtx_unlock(&th->mutex);
+		ag_message* stop = (ag_message*)ag_alloc(sizeof(ag_message));
+		if (!stop)
+			exit(-42);
+		stop->params[0] = 0;
+		ag_push_message(&th->in, stop);
+		ag_wake_thread(th);
+		if (th->pooled) {
+			// Pooled thread recycles itself. Workers don't wait for it, otherwise all of them can get blocked.
+			if (!ag_current_worker) {
+				mtx_lock(&th->mutex);
+				while (th->generation == generation)
+					cnd_wait(&th->is_not_empty, &th->mutex);
+				mtx_unlock(&th->mutex);
+			}
+		} else {
+			int unused_result;
+			thrd_join(th->thread, &unused_result);
+			th->next_free = ag_thread_free;
+			ag_thread_free = th;
+		}
 	}
 }
 void ag_visit_sys_Thread(
@@ -1304,4 +2546,9 @@ void ag_visit_sys_Thread(
 
 void ag_init() {
 	ag_current_thread = &ag_main_thread;
+	ag_main_thread.closed = 0;  // closed by the previous ag_handle_main_thread
+#ifdef AG_POOL_ALLOCATOR
+	if (!ag_current_pool)
+		ag_current_pool = &ag_main_thread.pool;
+#endif
 }
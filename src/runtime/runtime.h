@@ -19,6 +19,7 @@ typedef int bool;
 #define AG_CTR_MT ((uintptr_t) 1)
 #define AG_CTR_WEAK ((uintptr_t) 2)
 #define AG_CTR_STEP ((uintptr_t) 16)
+#define AG_CTR_IMMORTAL ((uintptr_t) 1 << (sizeof(uintptr_t) * 8 - 2))  // initial counter of static objects, never drops to zero
 
 typedef struct ag_thread_tag ag_thread;
 
@@ -71,8 +72,9 @@ typedef struct {
 
 typedef struct {
 	AgObject head;
-	uint64_t size;
+	uint64_t size;       // in items
 	int64_t* data;
+	uint64_t allocated;  // in items, grows geometrically
 } AgBlob;
 
 typedef struct {
@@ -80,6 +82,14 @@ typedef struct {
 	struct ag_thread_tag* thread;
 } AgThread;
 
+typedef struct {
+	AgObject head;
+	uint64_t count;
+	uint64_t capacity;     // in slots, 0 or power of two >= 16
+	uint64_t growth_left;  // empty slots that can be taken before rehash
+	int8_t*  ctrl;         // `capacity` control bytes followed by `capacity` entries
+} AgMap;
+
 bool ag_leak_detector_ok();
 uintptr_t ag_max_mem();
 
@@ -93,6 +103,7 @@ void      ag_set_parent         (AgObject* obj, AgObject* parent);
 bool      ag_splice             (AgObject* object, AgObject* parent);  // checks if parent is not already in object hierarchy, sets parent, retains
 AgObject* ag_copy               (AgObject* src);
 AgObject* ag_freeze             (AgObject* src);
+AgObject* ag_freeze_temp        (AgObject* src);  // takes over the retained temp `src`
 void      ag_release_pin        (AgObject* obj);
 // void   ag_retain_pin         (AgObject* obj); // inlined
 void      ag_release_shared     (AgObject* obj);
@@ -173,6 +184,24 @@ AgWeak*   ag_m_sys_WeakArray_getAt (AgBlob* b, uint64_t index);
 void      ag_m_sys_WeakArray_setAt (AgBlob* b, uint64_t index, AgWeak* val);
 void      ag_m_sys_WeakArray_delete(AgBlob* b, uint64_t index, uint64_t count);
 
+//
+// Map and WeakMap support
+//
+void      ag_copy_sys_Map          (AgMap* dst, AgMap* src);
+void      ag_dtor_sys_Map          (AgMap* ptr);
+void      ag_visit_sys_Map         (AgMap* ptr, void(*visitor)(void*, int, void*), void* ctx);
+AgObject* ag_m_sys_Map_getAt       (AgMap* m, AgObject* key);
+void      ag_m_sys_Map_setAt       (AgMap* m, AgObject* key, AgObject* val);
+bool      ag_m_sys_Map_delete      (AgMap* m, AgObject* key);
+int64_t   ag_m_sys_Map_size        (AgMap* m);
+void      ag_copy_sys_WeakMap      (AgMap* dst, AgMap* src);
+void      ag_dtor_sys_WeakMap      (AgMap* ptr);
+void      ag_visit_sys_WeakMap     (AgMap* ptr, void(*visitor)(void*, int, void*), void* ctx);
+AgWeak*   ag_m_sys_WeakMap_getAt   (AgMap* m, AgObject* key);
+void      ag_m_sys_WeakMap_setAt   (AgMap* m, AgObject* key, AgWeak* val);
+bool      ag_m_sys_WeakMap_delete  (AgMap* m, AgObject* key);
+int64_t   ag_m_sys_WeakMap_size    (AgMap* m);
+
 //
 // System
 //
@@ -182,6 +211,8 @@ void      ag_fn_sys_log           (AgString* s);
 
 //
 // Thread
+// Each thread runs on its own OS thread, unless AG_WORKERS environment variable is set.
+// In that case threads are multiplexed over AG_WORKERS worker OS threads (each thread runs on at most one worker at a time).
 //
 void      ag_copy_sys_Thread      (AgThread* dst, AgThread* src);
 void      ag_dtor_sys_Thread      (AgThread* ptr);
@@ -194,7 +225,8 @@ AgWeak*   ag_m_sys_Thread_root    (AgThread* th);
 //
 typedef void (*ag_fn)();
 
-bool ag_fn_sys_postTimer(int64_t at, AgWeak* receiver, ag_fn fn);
+int64_t ag_fn_sys_postTimer   (int64_t at, AgWeak* receiver, ag_fn fn);  // returns timer id, 0 on failure
+bool    ag_fn_sys_cancelTimer (int64_t timer_id);
 
 typedef void (*ag_trampoline) (AgObject* self, ag_fn entry_point, ag_thread* thread);
 // Trampoline is a function that reads parameters from the request queue and calls the actual function.
@@ -18,7 +18,8 @@ void register_runtime_content(struct ast::Ast& ast) {
 	ast.object = ast.mk_class("Object");
 	auto container = ast.mk_class("Container", {
 		ast.mk_field("_size", new ast::ConstInt64),
-		ast.mk_field("_data", new ast::ConstInt64) });
+		ast.mk_field("_data", new ast::ConstInt64),
+		ast.mk_field("_allocated", new ast::ConstInt64) });
 	ast.mk_method(mut::ANY, container, "capacity", FN(ag_m_sys_Container_capacity), new ast::ConstInt64, {});
 	ast.mk_method(mut::MUTATING, container, "insertItems", FN(&ag_m_sys_Container_insertItems), new ast::ConstVoid, { ast.tp_int64(), ast.tp_int64() });
 	ast.mk_method(mut::MUTATING, container, "moveItems", FN(&ag_m_sys_Container_moveItems), new ast::ConstBool, { ast.tp_int64(), ast.tp_int64(), ast.tp_int64() });
@@ -49,11 +50,11 @@ void register_runtime_content(struct ast::Ast& ast) {
 	opt_ref_to_object->p[1] = ref_to_object;
 	auto weak_to_object = new ast::MkWeakOp;
 	weak_to_object->p = inst;
-	auto add_class_param = [&](ltm::pin<ast::Class> cls) {
+	auto add_class_param = [&](ltm::pin<ast::Class> cls, const char* name = "T") {
 		auto param = ltm::pin<ast::ClassParam>::make();
 		cls->params.push_back(param);
 		param->base = ast.object;
-		param->name = "T";
+		param->name = name;
 		return param;
 	};
 	auto make_ptr_result = [&](ltm::pin<ast::UnaryOp> typer, ltm::pin<ast::AbstractClass> cls) {
@@ -90,6 +91,32 @@ void register_runtime_content(struct ast::Ast& ast) {
 		ast.mk_method(mut::MUTATING, ast.weak_array, "setAt", FN(ag_m_sys_WeakArray_setAt), new ast::ConstVoid, { ast.tp_int64(), ast.get_weak(t_cls) });
 		ast.mk_method(mut::MUTATING, ast.weak_array, "delete", FN(ag_m_sys_WeakArray_delete), new ast::ConstVoid, { ast.tp_int64(), ast.tp_int64() });
 	}
+	auto map = ast.mk_class("Map", {
+		ast.mk_field("_count", new ast::ConstInt64),
+		ast.mk_field("_capacity", new ast::ConstInt64),
+		ast.mk_field("_growthLeft", new ast::ConstInt64),
+		ast.mk_field("_ctrl", new ast::ConstInt64) });
+	{
+		auto k_cls = add_class_param(map, "K");
+		auto v_cls = add_class_param(map, "V");
+		ast.mk_method(mut::ANY, map, "getAt", FN(ag_m_sys_Map_getAt), make_opt_result(make_ptr_result(new ast::RefOp, v_cls)), { ast.get_conform_ref(k_cls) });
+		ast.mk_method(mut::MUTATING, map, "setAt", FN(ag_m_sys_Map_setAt), new ast::ConstVoid, { ast.get_shared(k_cls), ast.get_own(v_cls) });
+		ast.mk_method(mut::MUTATING, map, "delete", FN(ag_m_sys_Map_delete), new ast::ConstBool, { ast.get_conform_ref(k_cls) });
+		ast.mk_method(mut::ANY, map, "size", FN(ag_m_sys_Map_size), new ast::ConstInt64, {});
+	}
+	auto weak_map = ast.mk_class("WeakMap", {
+		ast.mk_field("_count", new ast::ConstInt64),
+		ast.mk_field("_capacity", new ast::ConstInt64),
+		ast.mk_field("_growthLeft", new ast::ConstInt64),
+		ast.mk_field("_ctrl", new ast::ConstInt64) });
+	{
+		auto k_cls = add_class_param(weak_map, "K");
+		auto v_cls = add_class_param(weak_map, "V");
+		ast.mk_method(mut::ANY, weak_map, "getAt", FN(ag_m_sys_WeakMap_getAt), make_ptr_result(new ast::MkWeakOp, v_cls), { ast.get_conform_ref(k_cls) });
+		ast.mk_method(mut::MUTATING, weak_map, "setAt", FN(ag_m_sys_WeakMap_setAt), new ast::ConstVoid, { ast.get_shared(k_cls), ast.get_weak(v_cls) });
+		ast.mk_method(mut::MUTATING, weak_map, "delete", FN(ag_m_sys_WeakMap_delete), new ast::ConstBool, { ast.get_conform_ref(k_cls) });
+		ast.mk_method(mut::ANY, weak_map, "size", FN(ag_m_sys_WeakMap_size), new ast::ConstInt64, {});
+	}
 	ast.string_cls = ast.mk_class("String", {
 		ast.mk_field("_cursor", new ast::ConstInt64),
 		ast.mk_field("_buffer", new ast::ConstInt64) });
@@ -100,10 +127,11 @@ void register_runtime_content(struct ast::Ast& ast) {
 	ast.mk_fn("log", FN(ag_fn_sys_log), new ast::ConstVoid, { ast.get_conform_ref(ast.string_cls) });
 	ast.mk_fn("terminate", FN(ag_fn_sys_terminate), new ast::ConstVoid, { ast.tp_int64() });
 	ast.mk_fn("setMainObject", FN(ag_fn_sys_setMainObject), new ast::ConstVoid, { ast.tp_optional(ast.get_ref(ast.object))});
-	ast.mk_fn("postTimer", FN(ag_fn_sys_postTimer), new ast::ConstVoid, {
+	ast.mk_fn("postTimer", FN(ag_fn_sys_postTimer), new ast::ConstInt64, {
 		ast.tp_int64(),
 		ast.tp_delegate({ ast.tp_void() })
 	});
+	ast.mk_fn("cancelTimer", FN(ag_fn_sys_cancelTimer), new ast::ConstBool, { ast.tp_int64() });
 	auto thread = ast.mk_class("Thread", {
 		ast.mk_field("_internal", new ast::ConstInt64) });
 	{
@@ -135,6 +163,7 @@ void register_runtime_content(struct ast::Ast& ast) {
 		{ "ag_set_parent", FN(ag_set_parent) },
 		{ "ag_splice", FN(ag_splice) },
 		{ "ag_freeze", FN(ag_freeze) },
+		{ "ag_freeze_temp", FN(ag_freeze_temp) },
 		{ "ag_unlock_thread_queue", FN(ag_unlock_thread_queue) }, // used in trampoline
 		{ "ag_get_thread_param", FN(ag_get_thread_param) }, // used in trampoline
 		{ "ag_prepare_post_message", FN(ag_prepare_post_message) }, // used in post~message
@@ -156,6 +185,12 @@ void register_runtime_content(struct ast::Ast& ast) {
 		{ "ag_copy_sys_WeakArray", FN(ag_copy_sys_WeakArray) },
 		{ "ag_dtor_sys_WeakArray", FN(ag_dtor_sys_WeakArray) },
 		{ "ag_visit_sys_WeakArray", FN(ag_visit_sys_WeakArray) },
+		{ "ag_copy_sys_Map", FN(ag_copy_sys_Map) },
+		{ "ag_dtor_sys_Map", FN(ag_dtor_sys_Map) },
+		{ "ag_visit_sys_Map", FN(ag_visit_sys_Map) },
+		{ "ag_copy_sys_WeakMap", FN(ag_copy_sys_WeakMap) },
+		{ "ag_dtor_sys_WeakMap", FN(ag_dtor_sys_WeakMap) },
+		{ "ag_visit_sys_WeakMap", FN(ag_visit_sys_WeakMap) },
 		{ "ag_copy_sys_String", FN(ag_copy_sys_String) },
 		{ "ag_dtor_sys_String", FN(ag_dtor_sys_String) },
 		{ "ag_visit_sys_String", FN(ag_visit_sys_String) },
@@ -5,8 +5,8 @@ namespace {
 
 using std::unordered_map;
 using vmt_util::bit_width;
-using vmt_util::extract_key_bits;
-using vmt_util::find_best_fit;
+using vmt_util::find_perfect_hash;
+using vmt_util::perfect_hash_index;
 
 TEST(VmtUtil, Widths) {
 	ASSERT_EQ(bit_width(0), 0);
@@ -34,61 +34,21 @@ TEST(VmtUtil, Widths) {
 	ASSERT_EQ(bit_width((1ULL << 48) + 1), 49);
 }
 
-TEST(VmtUtil, ExtractKeyBits) {
-	ASSERT_EQ(extract_key_bits(0b1000, 3, 1, 3), 1);
-	ASSERT_EQ(extract_key_bits(0b11000, 4, 2, 3), 3);
-	ASSERT_EQ(extract_key_bits(0b101000, 5, 2, 3), 3);
-	ASSERT_EQ(extract_key_bits(0b101000, 5, 3, 3), 5);
-	ASSERT_EQ(extract_key_bits(0xc000000000010000ULL, 63, 4, 16), 0x0d);
-}
-
-TEST(VmtUtil, FindBestFit63) {
-	auto r = find_best_fit<int>({ { ~0ULL, 0}, {0ULL, 0} });
-	ASSERT_EQ(r.splinter, 63);
-	ASSERT_EQ(r.width, 1);
-	ASSERT_EQ(r.spread, 2);
-}
-
-TEST(VmtUtil, FindBestFit32) {
-	auto r = find_best_fit<int>({ { 1ULL << 32, 0}, {0ULL, 0} });
-	ASSERT_EQ(r.splinter, 32);
-	ASSERT_EQ(r.width, 1);
-	ASSERT_EQ(r.spread, 2);
-}
-
-TEST(VmtUtil, FindBestFitSolid3x) {
-	auto r = find_best_fit<int>({
-		{ 1ULL << 32, 0},
-		{ 0ULL << 32, 1},
-		{ 2ULL << 32 | 1ULL << 63, 2}});
-	ASSERT_EQ(r.pos, 33);
-	ASSERT_EQ(r.splinter, 32);
-	ASSERT_EQ(r.width, 2);
-	ASSERT_EQ(r.spread, 3);
-}
-
-TEST(VmtUtil, FindBestFit4xWideSplinter) {
-	auto r = find_best_fit<int>({
-		{ 0ULL << 32, 0},
-		{ 1ULL << 32, 1},
-		{ 2ULL << 32 | 1ULL << 16, 2},
-		{ 2ULL << 32, 3} });
-	ASSERT_EQ(r.pos, 33);
-	ASSERT_EQ(r.splinter, 16);
-	ASSERT_EQ(r.width, 3);
-	ASSERT_EQ(r.spread, 4);
-}
-
-TEST(VmtUtil, FindBestFit4xStillCollisions) {
-	auto r = find_best_fit<int>({
-		{ 0ULL << 32, 0},
-		{ 1ULL << 32, 1},
-		{ 2ULL << 32 | 1ULL << 63, 2},
-		{ 2ULL << 32, 3} });
-	ASSERT_EQ(r.pos, 33);
-	ASSERT_EQ(r.splinter, 32);
-	ASSERT_EQ(r.width, 2);
-	ASSERT_EQ(r.spread, 3);
+TEST(VmtUtil, PerfectHash) {
+	unordered_map<uint64_t, int> table;
+	uint64_t x = 12345;
+	for (int i = 0; i < 100; i++) {
+		x = x * 6364136223846793005ull + 1442695040888963407ull;
+		table.insert({ x >> 16 << 16, i });
+	}
+	auto r = find_perfect_hash(table);
+	ASSERT_EQ(r.width < 15, true);
+	std::vector<bool> occupied(size_t(1) << r.width);
+	for (auto& ord : table) {
+		auto i = perfect_hash_index(ord.first | 0x1234, r);  // method index doesn't affect the slot
+		ASSERT_EQ(occupied[i], false);
+		occupied[i] = true;
+	}
 }
 
 }  // namespace
@@ -1,8 +1,9 @@
 #ifndef _VMT_UTIL_H_
 #define _VMT_UTIL_H_
 
+#include <algorithm>
 #include <unordered_map>
-#include <bitset>
+#include <vector>
 
 namespace vmt_util {
 
@@ -27,69 +28,48 @@ inline size_t bit_width(size_t value) {
 	return r;
 }
 
-// Extracts from `ord` `width` bits where separate 1 LSB bit at `splinter` position and all other bits are at position `msb`
-// Example:
-// width:5
-//         msb:10   splinter:2
-//          v       v
-// ord: ----1011----0-- 
-// result:  10110
-// If width == 1, msb position doesnt affect the result
-inline uint64_t extract_key_bits(uint64_t ord, size_t msb, size_t width, size_t splinter) {
-	auto hi_ord = ord << (63 - msb);
-	auto norm_ord = (hi_ord >> (64 - width)) & ~1ull;
-	auto splinter_bit = (ord >> splinter) & 1;
-	return norm_ord | splinter_bit;
-}
-
-struct fit_result {
-	size_t pos = 0; 
-	size_t splinter = 0;
+// Multiplicative hash that maps interface ordinals (48 random bits << 16) to distinct slots of `1 << width` table.
+struct perfect_hash {
+	uint64_t multiplier = 0;
 	size_t width = 0;
-	size_t spread = 0;
 };
 
+inline uint64_t perfect_hash_index(uint64_t ord, const perfect_hash& hash) {
+	return hash.width == 0 ? 0 : ((ord >> 16) * hash.multiplier) >> (64 - hash.width);
+}
+
+// Finds collision-free hash with the narrowest table.
+// For each width it tries `tries_per_width` multipliers, and widens the table on failure.
+// Every width >= 2*log2(size) succeeds with probability >1/2 per multiplier, so search always terminates.
 template <typename T>
-fit_result find_best_fit(const std::unordered_map<uint64_t, T>& table) {
-	fit_result best;
-	auto find_fit = [&](size_t width) {
-		auto check_fit = [&](size_t at, size_t splinter) {
-			size_t spread = 0;
-			std::bitset<64> occupied;
+perfect_hash find_perfect_hash(const std::unordered_map<uint64_t, T>& table, size_t tries_per_width = 1024) {
+	perfect_hash r;
+	uint64_t seed = 0x9e3779b97f4a7c15ull;
+	auto next_multiplier = [&] {  // splitmix64, deterministic to make builds reproducible
+		uint64_t z = (seed += 0x9e3779b97f4a7c15ull);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+		return (z ^ (z >> 31)) | 1;
+	};
+	std::vector<bool> occupied;
+	for (r.width = bit_width(table.size());; r.width++) {
+		occupied.resize(size_t(1) << r.width);
+		for (size_t i = 0; i < tries_per_width; i++) {
+			r.multiplier = next_multiplier();
+			std::fill(occupied.begin(), occupied.end(), false);
+			bool fit = true;
 			for (auto& ord : table) {
-				auto i = extract_key_bits(ord.first, at, width, splinter);
-				if (!occupied.test(i)) {
-					occupied.set(i);
-					spread++;
+				auto slot = perfect_hash_index(ord.first, r);
+				if (occupied[slot]) {
+					fit = false;
+					break;
 				}
+				occupied[slot] = true;
 			}
-			if (spread > best.spread) {
-				best.spread = spread;
-				best.pos = at;
-				best.splinter = splinter;
-				best.width = width;
-			}
-			return spread == table.size();
-		};
-		if (check_fit(63, 63 - width + 1))
-			return true;
-		for (size_t i = 16 + width - 1; i < 63; i++) {
-			if (check_fit(i, i - width + 1))
-				return true;
+			if (fit)
+				return r;
 		}
-		for (size_t i = 16 + width; i < 64; i++) {
-			for (size_t j = i - width; j >= 16; j--)
-				if (check_fit(i, j))
-					return true;
-		}
-		return false;
-	};
-	size_t starting_width = std::min(
-		vmt_util::bit_width(table.size()),
-		size_t(6));
-	if (!find_fit(starting_width) && starting_width < 6)
-		find_fit(starting_width + 1);
-	return best;
+	}
 }
 
 }  // namespace vmp_util